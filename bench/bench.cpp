@@ -0,0 +1,171 @@
+#include "expression.hpp"
+#include "flat_expression.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Times parse, eval, derivative, diff, to_string and write_to on synthetic expressions from 10 to 10^6
+// nodes and prints one JSON object per measurement:
+//   bench_runner [max_nodes] [shape]
+// An operation is skipped at the next size once its time there, projected from the current
+// time and the growth of ns_per_node, would pass ten seconds; a quadratic operation therefore
+// shows up as a steep ns_per_node followed by "skipped" entries. Every measured operation walks
+// the tree with an explicit stack, so the deep shapes run on the default stack.
+
+namespace {
+
+constexpr int variables = 16;
+constexpr double minimum_seconds = 0.2;
+constexpr double projected_limit_seconds = 10.0;
+
+std::string variable(std::size_t i) {
+    return "v" + std::to_string(i % variables);
+}
+
+std::string constant(std::size_t i) {
+    return std::to_string(i) + ".25";
+}
+
+// About three nodes per term: v_k * c_i, summed left to right, so the tree is wide and shallow
+// on the right but n / 3 levels deep on the left spine.
+std::string wide_sum(std::size_t nodes) {
+    std::string text = variable(0);
+    for (std::size_t i = 1; i < nodes / 3; ++i) {
+        text += " + " + variable(i) + " * " + constant(i);
+    }
+    return text;
+}
+
+// Product of (v_k + c_i) factors.
+std::string deep_product(std::size_t nodes) {
+    std::string text = variable(0);
+    for (std::size_t i = 1; i < nodes / 3; ++i) {
+        text += " * (" + variable(i) + " + " + constant(i) + ")";
+    }
+    return text;
+}
+
+// sin, cos and ln(exp()) nested inside one another, combined with a constant at every level.
+std::string transcendental_chain(std::size_t nodes) {
+    static const char* const prefixes[] = {"sin(", "cos(", "ln(exp("};
+    static const char* const operators[] = {" + ", " * ", " - "};
+    static const char* const suffixes[] = {")", ")", "))"};
+    std::size_t levels = nodes / 3;
+    std::string text;
+    for (std::size_t level = levels; level-- > 0;) {
+        text += prefixes[level % 3];
+    }
+    text += variable(0);
+    for (std::size_t level = 0; level < levels; ++level) {
+        text += operators[level % 3] + constant(level) + suffixes[level % 3];
+    }
+    return text;
+}
+
+struct Shape {
+    const char* name;
+    std::string (*generate)(std::size_t nodes);
+};
+
+struct Measurement {
+    double seconds;
+    std::size_t iterations;
+};
+
+Measurement measure(const std::function<void()>& operation) {
+    using clock = std::chrono::steady_clock;
+    std::size_t iterations = 0;
+    auto start = clock::now();
+    double elapsed = 0;
+    do {
+        operation();
+        ++iterations;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < minimum_seconds);
+    return {elapsed / iterations, iterations};
+}
+
+void report(const char* shape, std::size_t size, std::size_t nodes, const char* operation, const Measurement* m) {
+    if (!m) {
+        std::printf("{\"shape\": \"%s\", \"size\": %zu, \"operation\": \"%s\", \"skipped\": true}\n", shape, size, operation);
+    } else {
+        std::printf("{\"shape\": \"%s\", \"size\": %zu, \"nodes\": %zu, \"operation\": \"%s\", \"seconds\": %.9g, "
+                    "\"iterations\": %zu, \"ns_per_node\": %.4g}\n",
+                    shape, size, nodes, operation, m->seconds, m->iterations, m->seconds * 1e9 / nodes);
+    }
+    std::fflush(stdout);
+}
+
+struct Options {
+    std::size_t max_nodes = 1000000;
+    const char* shape = nullptr;
+};
+
+void run(const Options& options) {
+    const Shape shapes[] = {
+        {"wide_sum", wide_sum},
+        {"deep_product", deep_product},
+        {"transcendental_chain", transcendental_chain},
+    };
+    EvalContext<double> context;
+    for (int i = 0; i < variables; ++i) {
+        context.set(variable(i), 0.5 + i / 32.0);
+    }
+    for (const Shape& shape : shapes) {
+        if (options.shape && std::strcmp(options.shape, shape.name) != 0) {
+            continue;
+        }
+        std::map<std::string, bool> skipped;
+        std::map<std::string, double> previous_ns_per_node;
+        for (std::size_t size = 10; size <= options.max_nodes; size *= 10) {
+            std::string text = shape.generate(size);
+            Expression<double> expr(text);
+            std::size_t nodes = FlatExpression<double>(expr).size();
+            CompiledExpression<double> program = expr.compile();
+            std::uint32_t slot = SymbolTable::find(variable(0));
+            std::vector<std::pair<const char*, std::function<void()>>> operations = {
+                {"parse", [&] { Expression<double> parsed(text); }},
+                {"eval", [&] { volatile double value = expr.eval(context); (void)value; }},
+                {"compile", [&] { CompiledExpression<double> compiled = expr.compile(); }},
+                {"compiled_eval", [&] { volatile double value = program.eval(context); (void)value; }},
+                {"derivative", [&] { Expression<double> d = expr.derivative(slot); }},
+                {"diff", [&] { std::string d = expr.diff(variable(0)); }},
+                {"to_string", [&] { std::string s = expr.to_string(); }},
+                {"write_to", [&] { std::string s; expr.write_to(s); }},
+            };
+            for (auto& [name, operation] : operations) {
+                if (skipped[name]) {
+                    report(shape.name, size, nodes, name, nullptr);
+                    continue;
+                }
+                Measurement m = measure(operation);
+                report(shape.name, size, nodes, name, &m);
+                double ns_per_node = m.seconds * 1e9 / nodes;
+                double growth = previous_ns_per_node.contains(name) ? std::max(1.0, ns_per_node / previous_ns_per_node[name]) : 1.0;
+                previous_ns_per_node[name] = ns_per_node;
+                skipped[name] = m.seconds * 10 * growth > projected_limit_seconds;
+            }
+        }
+    }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (argc > 1) {
+        options.max_nodes = std::strtoull(argv[1], nullptr, 10);
+    }
+    if (argc > 2) {
+        options.shape = argv[2];
+    }
+    run(options);
+    return 0;
+}
@@ -5,14 +5,222 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <vector>
+#include <cstdint>
+#include <span>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <string_view>
+#include <iosfwd>
+#include <complex>
+#include <type_traits>
+#include <cmath>
+#include <cstddef>
+#include <functional>
 
 template<typename T>
-class ExpressionImpl {
+struct is_std_complex_helper : std::false_type {};
+
+template<typename T>
+struct is_std_complex_helper<std::complex<T>> : std::true_type {};
+
+// True for std::complex<R> whatever its cv and reference qualifiers.
+template<typename T>
+struct is_std_complex : is_std_complex_helper<std::remove_cv_t<std::remove_reference_t<T>>> {};
+
+inline std::size_t hash_combine(std::size_t seed, std::size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+// Hash of a constant consistent with same_constant, complex values included.
+template<typename T>
+std::size_t hash_constant(const T& value) {
+    if constexpr (is_std_complex<T>::value) {
+        return hash_combine(hash_constant(value.real()), hash_constant(value.imag()));
+    } else {
+        return std::hash<T>()(value);
+    }
+}
+
+// Bitwise-faithful equality for constants: 0.0 and -0.0 compare different, so they stay
+// distinct nodes and distinct pool entries.
+template<typename T>
+bool same_constant(const T& a, const T& b) {
+    if constexpr (is_std_complex<T>::value) {
+        return same_constant(a.real(), b.real()) && same_constant(a.imag(), b.imag());
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return a == b && std::signbit(a) == std::signbit(b);
+    } else {
+        return a == b;
+    }
+}
+
+enum class OpCode : std::uint8_t {
+    Value,
+    Variable,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Pow,
+    Sin,
+    Cos,
+    Ln,
+    Exp
+};
+
+// One step of a compiled expression: dst = op(lhs, rhs).
+// For Value lhs indexes the constant pool, for Variable it indexes the variable table,
+// otherwise lhs and rhs are registers.
+struct Instruction {
+    OpCode op;
+    std::uint32_t dst;
+    std::uint32_t lhs;
+    std::uint32_t rhs;
+};
+
+// Process-wide interning of variable names into dense slots.
+// A Variable receives its slot when it is built, so evaluation reads variables by index.
+class SymbolTable {
+public:
+    static constexpr std::uint32_t npos = UINT32_MAX;
+
+    static std::uint32_t intern(const std::string& name);
+    static std::uint32_t find(const std::string& name);
+    static const std::string& name(std::uint32_t slot);
+    static std::uint32_t size();
+};
+
+// Bump allocator for expression nodes. While a Scope is active on a thread, every node that
+// thread creates is carved out of the arena's chunks instead of a heap allocation of its own.
+// Nodes keep the chunks alive, so an expression may outlive the arena object; the chunks are
+// released together once the arena and the last node allocated from it are gone.
+// An arena must be active on at most one thread at a time.
+class ExpressionArena {
+public:
+    explicit ExpressionArena(std::size_t chunk_bytes = 64 * 1024);
+    ExpressionArena(const ExpressionArena&) = delete;
+    ExpressionArena& operator=(const ExpressionArena&) = delete;
+
+    // Makes the arena current for the calling thread until the scope ends.
+    class Scope {
+    public:
+        explicit Scope(ExpressionArena& arena);
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope();
+    private:
+        ExpressionArena* previous_;
+    };
+
+    static ExpressionArena* current();
+    std::shared_ptr<std::pmr::memory_resource> resource() const;
+    // Bytes handed out to nodes so far, including nodes dropped by hash-consing.
+    std::size_t bytes_allocated() const;
+private:
+    class Storage;
+    std::shared_ptr<Storage> storage_;
+};
+
+// Variable values indexed by SymbolTable slot. Either owns its values (filled through set)
+// or views a caller-provided span in which every slot is bound.
+template<typename T>
+class EvalContext {
+public:
+    EvalContext() = default;
+    EvalContext(std::span<const T> values);
+    EvalContext(const std::map<std::string, T>& values);
+    EvalContext(const EvalContext& copy);
+    EvalContext& operator=(const EvalContext& that);
+
+    void set(std::uint32_t slot, T value);
+    void set(const std::string& name, T value);
+    void clear();
+
+    bool contains(std::uint32_t slot) const;
+    T operator[](std::uint32_t slot) const;
+    std::span<const T> values() const;
+private:
+    std::vector<T> values_;
+    std::vector<unsigned char> bound_;
+    std::span<const T> view_;
+};
+
+class ThreadPool;
+
+// Value carried together with its derivative along one direction (forward-mode AD).
+template<typename T>
+struct Dual {
+    T value;
+    T derivative;
+};
+
+// Closed range of values [lo, hi]. A program run over intervals rounds every bound outwards,
+// so the result encloses every value the expression takes with its variables in their ranges.
+template<typename T>
+struct Interval {
+    T lo;
+    T hi;
+
+    Interval() = default;
+    Interval(T point);
+    Interval(T lo, T hi);
+    bool contains(T value) const;
+};
+
+// Value together with the partial derivative by every variable.
+template<typename T>
+struct Gradient {
+    T value;
+    // Indexed by SymbolTable slot; zero for variables the expression does not read.
+    std::vector<T> partials;
+};
+
+template<typename T>
+class ExpressionParser;
+
+template<typename T>
+class ProgramBuilder;
+
+template<typename T>
+class CompiledExpression;
+
+template<typename T>
+class Expression;
+
+// What Expression::derivative knows about a node's operands when it differentiates the node:
+// the derivative of operand(i) by the variable in slot, and whether operand(i) reads it at all.
+template<typename T>
+struct OperandDerivatives {
+    std::uint32_t slot;
+    const Expression<T>* derivative[2];
+    bool depends[2];
+};
+
+template<typename T>
+class ExpressionImpl : public std::enable_shared_from_this<ExpressionImpl<T>> {
 public:
-    virtual ~ExpressionImpl() = default;
-    virtual T eval(std::map<std::string, T> context) const = 0;
-    virtual std::string to_string() const = 0;
-    virtual std::string diff(std::string var) const = 0;
+    virtual ~ExpressionImpl();
+    // Value of this node given its operands' values, operands[i] being that of operand(i).
+    virtual T eval(const EvalContext<T>& context, const T* operands) const = 0;
+    // Fully parenthesized, with numbers in std::to_string's fixed six-digit form.
+    std::string to_string() const;
+    // Derivative by the variable in operands.slot, built from nodes that share this node's
+    // subtrees and the derivatives of its operands.
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const = 0;
+    virtual OpCode op() const = 0;
+    // Operand by position, nullptr past the node's arity.
+    virtual const Expression<T>* operand(std::size_t index) const = 0;
+    // Same kind and payload over the very same operand nodes.
+    virtual bool same(const ExpressionImpl<T>& other) const = 0;
+    // Structural hash, fixed at construction from the kind, payload and operand hashes.
+    std::size_t hash() const;
+protected:
+    Expression<T> self() const;
+    std::size_t hash_ = 0;
 };
 
 template<typename T>
@@ -23,19 +231,19 @@ public:
     Expression(const Expression& copy);
     Expression(Expression&& moved);
     Expression() = default;
-    ~Expression() = default;
+    ~Expression();
 
     Expression<T>& operator= (const Expression<T>& that);
     Expression<T>& operator=(Expression&& that);
-    Expression<T> operator+ (const Expression<T>& that);
+    Expression<T> operator+ (const Expression<T>& that) const;
     Expression<T>& operator+=(const Expression<T>& that);
-    Expression<T> operator- (const Expression<T>& that);
+    Expression<T> operator- (const Expression<T>& that) const;
     Expression<T>& operator-=(const Expression<T>& that);
-    Expression<T> operator* (const Expression<T>& that);
+    Expression<T> operator* (const Expression<T>& that) const;
     Expression<T>& operator*=(const Expression<T>& that);
-    Expression<T> operator/ (const Expression<T>& that);
+    Expression<T> operator/ (const Expression<T>& that) const;
     Expression<T>& operator/=(const Expression<T>& that);
-    Expression<T> operator^ (const Expression<T>& that);
+    Expression<T> operator^ (const Expression<T>& that) const;
     Expression<T>& operator^=(const Expression<T>& that);
 
     template<typename V>
@@ -47,23 +255,214 @@ public:
     template<typename V>
     friend Expression<V> exp(Expression<V> that);
 
-    T eval(std::map<std::string, T> context) const;
+    T eval(const std::map<std::string, T>& context) const;
+    T eval(const EvalContext<T>& context) const;
+    T eval(std::span<const T> values) const;
+    // Evaluates n rows stored column-wise, one array per variable, writing one result per row.
+    void eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out) const;
+    void eval_batch(std::span<const T* const> columns, std::size_t n, T* out) const;
+    // Same, with the rows split into chunks spread across pool.
+    void eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out, ThreadPool& pool) const;
+    void eval_batch(std::span<const T* const> columns, std::size_t n, T* out, ThreadPool& pool) const;
     std::string to_string() const;
+    // The first max_length characters of to_string(), without writing the rest.
+    std::string to_string(std::size_t max_length) const;
+    // Compact text: shortest round-trip numbers and only the parentheses the parser needs to
+    // rebuild the same tree. Appends to out; the stream version writes in 64 KiB pieces.
+    void write_to(std::string& out) const;
+    void write_to(std::ostream& out) const;
+    // Compact text in which every operation reached along more than one path is printed once,
+    // as a temporary named before its first use: "t1 = ...; t2 = ...; result = ...".
+    // Its length is linear in the number of distinct nodes, however much they are shared.
+    void write_shared(std::string& out, std::string_view result = "result") const;
     std::string diff(std::string var) const;
+    // Derivative by var in the write_shared form.
+    std::string diff_shared(std::string var) const;
+    Expression<T> derivative(const std::string& var) const;
+    Expression<T> derivative(std::uint32_t slot) const;
+    bool depends_on(std::uint32_t slot) const;
+    // Value and derivative by var from a single forward pass over dual numbers.
+    Dual<T> eval_with_derivative(const std::map<std::string, T>& context, const std::string& var) const;
+    Dual<T> eval_with_derivative(const EvalContext<T>& context, const std::string& var) const;
+    // Value and all partial derivatives from one forward pass and one reverse (adjoint) sweep.
+    Gradient<T> eval_gradient(const std::map<std::string, T>& context) const;
+    Gradient<T> eval_gradient(const EvalContext<T>& context) const;
+    // Enclosure of the expression's values with every variable anywhere in its range.
+    // Complex values have no ordering, so there is no interval form for them.
+    Interval<T> eval_interval(const std::map<std::string, Interval<T>>& ranges) const requires (!is_std_complex<T>::value);
+    // Folds constant subtrees, drops identity operations (x + 0, x * 1, x ^ 1, x - x, ln(exp(x)), ...)
+    // and puts the operands of + and * in a canonical order. For complex T, ln(exp(x)) is kept:
+    // it equals x only while the imaginary part of x lies in (-pi, pi].
+    Expression<T> simplify() const;
+    const ExpressionImpl<T>* node() const;
+    // Nodes are hash-consed, so equal structure means the same node.
+    std::size_t hash() const;
+    // Estimated heap bytes of the nodes reachable from this expression, shared ones counted once.
+    std::size_t memory_bytes() const;
+    bool operator==(const Expression<T>& that) const;
+    CompiledExpression<T> compile() const;
 private:
+    friend class ExpressionParser<T>;
+    friend class ExpressionImpl<T>;
     Expression(std::shared_ptr<ExpressionImpl<T>> impl);
     std::shared_ptr<ExpressionImpl<T>> impl_;
 };
 
+// Writes expr.write_to(out).
+template<typename T>
+std::ostream& operator<<(std::ostream& out, const Expression<T>& expr);
+
+struct ParseCacheStats {
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t evictions = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+};
+
+// Bounded least-recently-used cache from expression text to the parsed expression.
+// Each entry is charged for its text plus an estimate for every node reachable from its root,
+// and entries are evicted from the cold end once the total passes the byte budget. Text is
+// parsed outside the lock, so a slow parse never blocks hits on other entries.
+template<typename T>
+class ParseCache {
+public:
+    explicit ParseCache(std::size_t byte_budget);
+    ParseCache(const ParseCache&) = delete;
+    ParseCache& operator=(const ParseCache&) = delete;
+
+    Expression<T> parse(const std::string& text);
+    void set_budget(std::size_t byte_budget);
+    std::size_t budget() const;
+    void clear();
+    ParseCacheStats stats() const;
+
+    // Cache consulted by Expression<T>(std::string). Its budget starts at 0, which bypasses it.
+    static ParseCache& shared();
+private:
+    struct Entry {
+        std::string text;
+        Expression<T> expr;
+        std::size_t bytes;
+    };
+
+    static std::size_t cost(const std::string& text, const Expression<T>& expr);
+    void evict();
+
+    mutable std::mutex mutex_;
+    std::list<Entry> entries_;
+    std::unordered_map<std::string_view, typename std::list<Entry>::iterator> index_;
+    std::atomic<std::size_t> budget_;
+    ParseCacheStats stats_;
+};
+
+// Instruction set of the packed kernels eval_batch uses for double and std::complex<double>,
+// narrowest first. The widest one the CPU supports is chosen when the program starts.
+enum class BatchKernels : std::uint8_t {
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+BatchKernels batch_kernels();
+// Switches every thread to kernels, e.g. to compare them; returns false and changes nothing
+// when the CPU does not support them.
+bool set_batch_kernels(BatchKernels kernels);
+
+// Flat register program produced by Expression<T>::compile().
+// Evaluates the same formula as the tree with a single dispatch loop.
+template<typename T>
+class CompiledExpression {
+public:
+    CompiledExpression() = default;
+
+    T eval(const std::map<std::string, T>& context) const;
+    T eval(const EvalContext<T>& context) const;
+    T eval(std::span<const T> values) const;
+    // Runs the program over variables indexed by slot, using caller-provided registers.
+    T run(const T* variables, T* registers) const;
+
+    // Forward-mode differentiation: each variable carries its own tangent, indexed by slot.
+    Dual<T> eval_dual(std::span<const Dual<T>> variables) const;
+    // Tangent 1 for slot and 0 for every other variable.
+    Dual<T> eval_with_derivative(const EvalContext<T>& context, std::uint32_t slot) const;
+    Gradient<T> eval_gradient(const EvalContext<T>& context) const;
+    // Interval evaluation with the range of each variable indexed by slot. Division by a range
+    // containing zero gives a half-line or the whole line instead of throwing; ln and pow ignore
+    // the part of a range outside their domain and give NaN bounds when nothing is left.
+    Interval<T> eval_interval(std::span<const Interval<T>> variables) const requires (!is_std_complex<T>::value);
+    Interval<T> eval_interval(const std::map<std::string, Interval<T>>& ranges) const requires (!is_std_complex<T>::value);
+
+    // Rows are processed in blocks of batch_block; columns are indexed by slot.
+    static constexpr std::size_t batch_block = 256;
+    void eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out) const;
+    void eval_batch(std::span<const T* const> columns, std::size_t n, T* out) const;
+    void eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out, ThreadPool& pool) const;
+    void eval_batch(std::span<const T* const> columns, std::size_t n, T* out, ThreadPool& pool) const;
+    // Rows per parallel chunk, sized so a chunk's columns fit in L2.
+    std::size_t batch_chunk_rows() const;
+    // Evaluates rows [begin, end) using scratch of at least batch_scratch_size() elements.
+    void run_batch(const T* const* columns, std::size_t begin, std::size_t end, T* out, T* scratch) const;
+    std::size_t batch_scratch_size() const;
+
+    const std::vector<Instruction>& code() const;
+    const std::vector<T>& constants() const;
+    const std::vector<std::uint32_t>& slots() const;
+    std::vector<std::string> variables() const;
+    std::uint32_t registers() const;
+    std::uint32_t result() const;
+private:
+    friend class ProgramBuilder<T>;
+    void check_columns(std::span<const T* const> columns) const;
+    void check_bound(const EvalContext<T>& context) const;
+    template<typename S>
+    S execute(const S* variables, S* registers) const;
+    std::vector<const T*> columns_by_slot(const std::map<std::string, const T*>& columns) const;
+    std::vector<Instruction> code_;
+    std::vector<T> constants_;
+    std::vector<std::uint32_t> slots_;
+    std::uint32_t registers_ = 0;
+    std::uint32_t result_ = 0;
+};
+
+template<typename T>
+class ProgramBuilder {
+public:
+    ProgramBuilder() = default;
+
+    std::uint32_t emit_value(T value);
+    std::uint32_t emit_variable(std::uint32_t slot);
+    std::uint32_t emit(OpCode op, std::uint32_t lhs, std::uint32_t rhs = 0);
+    CompiledExpression<T> finish(std::uint32_t result);
+
+    // Counts how many parents read each node of root, so shared subtrees are emitted once
+    // and keep their register until the last reader.
+    void count_uses(const Expression<T>& root);
+    bool lookup(const ExpressionImpl<T>* node, std::uint32_t& reg) const;
+    void remember(const ExpressionImpl<T>* node, std::uint32_t reg);
+private:
+    std::uint32_t allocate();
+    void release(std::uint32_t reg);
+
+    CompiledExpression<T> program_;
+    std::vector<std::uint32_t> free_;
+    std::vector<std::uint32_t> readers_;
+    std::unordered_map<const ExpressionImpl<T>*, std::uint32_t> uses_;
+    std::unordered_map<const ExpressionImpl<T>*, std::uint32_t> emitted_;
+};
+
 template<typename T>
 class Value : public ExpressionImpl<T> {
 public:
     Value(T value);
     virtual ~Value() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override ;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
+    T value() const;
 private:
     T value_;
 };
@@ -74,11 +473,16 @@ public:
     Variable(std::string value);
     virtual ~Variable() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
+    const std::string& name() const;
+    std::uint32_t slot() const;
 private:
     std::string name_;
+    std::uint32_t slot_;
 };
 
 template<typename T>
@@ -87,9 +491,11 @@ public:
     OperationAdd(Expression<T> left, Expression<T> right);
     virtual ~OperationAdd() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> left_;
     Expression<T> right_;
@@ -101,9 +507,11 @@ public:
     OperationSub(Expression<T> left, Expression<T> right);
     virtual ~OperationSub() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> left_;
     Expression<T> right_;
@@ -115,9 +523,11 @@ public:
     OperationMul(Expression<T> left, Expression<T> right);
     virtual ~OperationMul() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> left_;
     Expression<T> right_;
@@ -129,9 +539,11 @@ public:
     OperationDiv(Expression<T> left, Expression<T> right);
     virtual ~OperationDiv() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> left_;
     Expression<T> right_;
@@ -143,9 +555,11 @@ public:
     OperationPow(Expression<T> left, Expression<T> right);
     virtual ~OperationPow() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> left_;
     Expression<T> right_;
@@ -157,9 +571,11 @@ public:
     OperationSin(Expression<T> expr);
     virtual ~OperationSin() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> expr_;
 };
@@ -170,9 +586,11 @@ public:
     OperationCos(Expression<T> expr);
     virtual ~OperationCos() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> expr_;
 };
@@ -183,9 +601,11 @@ public:
     OperationLn(Expression<T> expr);
     virtual ~OperationLn() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> expr_;
 };
@@ -196,9 +616,11 @@ public:
     OperationExp(Expression<T> expr);
     virtual ~OperationExp() override = default;
 
-    virtual T eval(std::map<std::string, T> context) const override;
-    virtual std::string to_string() const override;
-    virtual std::string diff(std::string var) const override;
+    virtual T eval(const EvalContext<T>& context, const T* operands) const override;
+    virtual Expression<T> derivative(const OperandDerivatives<T>& operands) const override;
+    virtual OpCode op() const override;
+    virtual const Expression<T>* operand(std::size_t index) const override;
+    virtual bool same(const ExpressionImpl<T>& other) const override;
 private:
     Expression<T> expr_;
 };
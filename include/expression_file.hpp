@@ -0,0 +1,76 @@
+#pragma once
+#ifndef EXPRESSION_FILE_HPP
+#define EXPRESSION_FILE_HPP
+
+#include "flat_expression.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary format of a FlatExpression. Every section is addressed by an offset from the start
+// of the file, so a file can be mapped anywhere and read in place:
+//   header | nodes (12 bytes each) | constants (16-byte aligned) | names | source text
+// Variable nodes hold an index into the file's own name table rather than a process slot;
+// names are {offset, length} pairs followed by the characters. The source text is optional
+// and lets a cache keyed by a hash of the text detect collisions.
+// Files are written in the host byte order, which byte_order records; a reader rejects files
+// from a host of the other order, a newer version or another value type.
+struct ExpressionFileHeader {
+    char magic[8];
+    std::uint32_t byte_order;
+    std::uint32_t version;
+    std::uint32_t value_type;
+    std::uint32_t value_size;
+    std::uint32_t node_count;
+    std::uint32_t constant_count;
+    std::uint32_t variable_count;
+    std::uint32_t source_size;
+    std::uint64_t nodes_offset;
+    std::uint64_t constants_offset;
+    std::uint64_t names_offset;
+    std::uint64_t source_offset;
+};
+
+template<typename T>
+std::string save_expression(const FlatExpression<T>& expr, std::string_view source = {});
+template<typename T>
+void save_expression_file(const std::string& path, const FlatExpression<T>& expr, std::string_view source = {});
+// Variables are interned into the SymbolTable of the loading process.
+template<typename T>
+FlatExpression<T> load_expression(std::string_view bytes);
+
+// Read-only mapping of an expression file. Nodes and constants are used straight from the
+// mapped pages; only the variable names are resolved to slots when the file is opened.
+template<typename T>
+class MappedExpression {
+public:
+    explicit MappedExpression(const std::string& path);
+    MappedExpression(const MappedExpression&) = delete;
+    MappedExpression& operator=(const MappedExpression&) = delete;
+    MappedExpression(MappedExpression&& moved);
+    MappedExpression& operator=(MappedExpression&& that);
+    ~MappedExpression();
+
+    T eval(const std::map<std::string, T>& context) const;
+    T eval(const EvalContext<T>& context) const;
+    FlatExpression<T> flat() const;
+    Expression<T> to_expression() const;
+
+    std::span<const FlatNode> nodes() const;
+    std::span<const T> constants() const;
+    std::string_view source() const;
+private:
+    void release();
+
+    void* pages_ = nullptr;
+    std::size_t size_ = 0;
+    std::span<const FlatNode> nodes_;
+    std::span<const T> constants_;
+    std::string_view source_;
+    std::vector<std::uint32_t> slots_;
+};
+
+#endif
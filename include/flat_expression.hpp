@@ -0,0 +1,90 @@
+#pragma once
+#ifndef FLAT_EXPRESSION_HPP
+#define FLAT_EXPRESSION_HPP
+
+#include "expression.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <ranges>
+#include <span>
+#include <vector>
+
+// One node of a FlatExpression. For Value lhs indexes the constant pool, for Variable it is
+// the SymbolTable slot, otherwise lhs and rhs index earlier nodes (rhs is 0 for unary nodes).
+struct FlatNode {
+    OpCode op;
+    std::uint32_t lhs;
+    std::uint32_t rhs;
+
+    bool operator==(const FlatNode& that) const = default;
+};
+
+// Expression stored as a vector of POD nodes in post-order: every operand precedes its parent
+// and the last node is the root. Subtrees shared in the source DAG are stored once.
+// Copying, hashing and comparing are linear scans with no pointers or reference counts.
+template<typename T>
+class FlatExpression {
+public:
+    FlatExpression() = default;
+    explicit FlatExpression(const Expression<T>& expr);
+    // Several expressions in one program, sharing the nodes they have in common; roots() gives
+    // the node of each, and the last node is the root of the last one.
+    explicit FlatExpression(std::span<const Expression<T>> exprs);
+    // Takes nodes as produced elsewhere (e.g. loaded from a file); throws unless every operand
+    // precedes its parent and every constant index is in range.
+    FlatExpression(std::vector<FlatNode> nodes, std::vector<T> constants);
+
+    Expression<T> to_expression() const;
+    // Every node as an Expression, by node index; the last one is to_expression().
+    std::vector<Expression<T>> expressions() const;
+    T eval(const std::map<std::string, T>& context) const;
+    T eval(const EvalContext<T>& context) const;
+    // Value of a non-Variable node from the values of the nodes before it.
+    T apply(const FlatNode& node, const T* values) const;
+    static T apply(const FlatNode& node, const T* constants, const T* values);
+    // Computes values[i] for every node index i in order, which must be ascending so operands
+    // come first. A Variable node reads context at its slot, or at slots[lhs] when slots is not
+    // empty, and throws when that slot is unbound. after(i) runs as soon as node i is done.
+    // Every evaluator over flat nodes runs through here.
+    template<typename Order, typename After>
+    static void run(std::span<const FlatNode> nodes, const T* constants, T* values, const EvalContext<T>& context,
+                    const Order& order, std::span<const std::uint32_t> slots, After&& after);
+    // Same over every node.
+    static void run(std::span<const FlatNode> nodes, const T* constants, T* values, const EvalContext<T>& context,
+                    std::span<const std::uint32_t> slots = {});
+    // Throws unless the nodes form a valid post-order program over constant_count constants
+    // with every variable index below variable_count.
+    static void validate(std::span<const FlatNode> nodes, std::size_t constant_count, std::size_t variable_count = SIZE_MAX);
+
+    const std::vector<FlatNode>& nodes() const;
+    const std::vector<T>& constants() const;
+    const std::vector<std::uint32_t>& roots() const;
+    std::size_t size() const;
+    std::size_t hash() const;
+    bool operator==(const FlatExpression<T>& that) const;
+private:
+    std::vector<FlatNode> nodes_;
+    std::vector<T> constants_;
+    std::vector<std::uint32_t> roots_;
+};
+
+template<typename T>
+template<typename Order, typename After>
+void FlatExpression<T>::run(std::span<const FlatNode> nodes, const T* constants, T* values, const EvalContext<T>& context,
+                            const Order& order, std::span<const std::uint32_t> slots, After&& after) {
+    for (std::size_t i : order) {
+        const FlatNode& n = nodes[i];
+        if (n.op != OpCode::Variable) {
+            values[i] = apply(n, constants, values);
+        } else {
+            std::uint32_t slot = slots.empty() ? n.lhs : slots[n.lhs];
+            if (!context.contains(slot)) {
+                throw("The variable \"" + SymbolTable::name(slot) + "\" is undefined\n");
+            }
+            values[i] = context[slot];
+        }
+        after(i);
+    }
+}
+
+#endif
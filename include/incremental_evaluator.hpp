@@ -0,0 +1,40 @@
+#pragma once
+#ifndef INCREMENTAL_EVALUATOR_HPP
+#define INCREMENTAL_EVALUATOR_HPP
+
+#include "flat_expression.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Evaluator bound to one expression that keeps every node's last value. Setting a variable
+// marks the nodes on its paths to the root; eval() recomputes only those, in node order.
+// Setting a variable to the value it already holds marks nothing.
+template<typename T>
+class IncrementalEvaluator {
+public:
+    explicit IncrementalEvaluator(const Expression<T>& expr);
+
+    void set(std::uint32_t slot, T value);
+    void set(const std::string& name, T value);
+    // Every variable of the expression must have been set at least once.
+    T eval();
+    // Nodes recomputed by the last eval().
+    std::size_t recomputed() const;
+    std::size_t size() const;
+private:
+    void mark(std::uint32_t node);
+
+    FlatExpression<T> flat_;
+    std::vector<T> values_;
+    std::vector<std::vector<std::uint32_t>> parents_;
+    // Variable nodes by slot; a hash-consed expression has at most one per slot.
+    std::vector<std::uint32_t> variables_;
+    EvalContext<T> inputs_;
+    std::vector<unsigned char> marked_;
+    std::vector<std::uint32_t> pending_;
+    std::size_t recomputed_ = 0;
+};
+
+#endif
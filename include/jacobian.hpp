@@ -0,0 +1,75 @@
+#pragma once
+#ifndef JACOBIAN_HPP
+#define JACOBIAN_HPP
+
+#include "flat_expression.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <string>
+#include <vector>
+
+// Positions of the structurally non-zero entries of a rows x columns matrix, row by row: the
+// entries of row r are column[row_begin[r]] up to column[row_begin[r + 1] - 1], in increasing
+// column order.
+struct SparsityPattern {
+    std::size_t rows = 0;
+    std::size_t columns = 0;
+    std::vector<std::uint32_t> row_begin;
+    std::vector<std::uint32_t> column;
+
+    std::size_t nonzeros() const;
+    // Index of (row, column) among the non-zeros, or nonzeros() when the entry is structurally zero.
+    std::size_t find(std::size_t row, std::size_t column) const;
+};
+
+template<typename T>
+struct SparseMatrix {
+    SparsityPattern pattern;
+    // One value per non-zero, in pattern order.
+    std::vector<T> values;
+
+    T at(std::size_t row, std::size_t column) const;
+    // Row-major copy with the zeros filled in.
+    std::vector<T> dense() const;
+};
+
+// Partial derivatives of several functions by a common list of variables: row r holds the
+// derivatives of functions[r], column c those by variables[c]. An entry is only built when the
+// function reads the variable and its simplified derivative is not the constant 0. All entries
+// are flattened into one program, so subexpressions shared between entries are evaluated once.
+template<typename T>
+class Jacobian {
+public:
+    // Without variables the columns are every variable the functions read, ordered by name.
+    explicit Jacobian(const std::vector<Expression<T>>& functions, std::vector<std::string> variables = {});
+    // Second derivatives of a scalar function. Only entries on and below the diagonal are
+    // differentiated; the ones above reuse them.
+    static Jacobian hessian(const Expression<T>& function, std::vector<std::string> variables = {});
+
+    const SparsityPattern& pattern() const;
+    const std::vector<std::string>& variables() const;
+    // Symbolic entries, one per non-zero in pattern order.
+    const std::vector<Expression<T>>& entries() const;
+    // The constant 0 for a structurally zero entry.
+    Expression<T> entry(std::size_t row, std::size_t column) const;
+
+    SparseMatrix<T> eval(const std::map<std::string, T>& context) const;
+    SparseMatrix<T> eval(const EvalContext<T>& context) const;
+    // Writes the non-zeros in pattern order; values must hold pattern().nonzeros() elements.
+    void eval(const EvalContext<T>& context, std::span<T> values) const;
+private:
+    using Row = std::vector<std::pair<std::uint32_t, Expression<T>>>;
+
+    Jacobian() = default;
+    void build(std::vector<Row> rows);
+
+    std::vector<std::string> variables_;
+    SparsityPattern pattern_;
+    std::vector<Expression<T>> entries_;
+    // Every entry, its roots in pattern order.
+    FlatExpression<T> flat_;
+};
+
+#endif
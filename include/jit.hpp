@@ -0,0 +1,48 @@
+#pragma once
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "expression.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Native x86-64 code for a compiled Expression<double>, placed in its own mmap'd pages.
+// Program registers live in a spill area addressed off rbx, variables are read off rbp,
+// arithmetic uses scalar SSE2 and sin/cos/exp/ln/pow call into libm.
+class JitExpression {
+public:
+    explicit JitExpression(const Expression<double>& expr);
+    explicit JitExpression(const CompiledExpression<double>& program);
+    JitExpression(const JitExpression&) = delete;
+    JitExpression& operator=(const JitExpression&) = delete;
+    JitExpression(JitExpression&& moved);
+    JitExpression& operator=(JitExpression&& that);
+    ~JitExpression();
+
+    // False on targets the code generator does not know; constructing a JitExpression there throws.
+    static bool supported();
+
+    double eval(const std::map<std::string, double>& context) const;
+    double eval(const EvalContext<double>& context) const;
+    double eval(std::span<const double> values) const;
+    // Runs the generated code over variables indexed by slot. registers must hold scratch_size()
+    // elements; the last one is set non-zero when a division by zero aborted the run.
+    double run(const double* variables, double* registers) const;
+    std::size_t scratch_size() const;
+    std::size_t code_size() const;
+private:
+    using Function = double (*)(const double* variables, double* registers);
+
+    void release();
+
+    void* pages_ = nullptr;
+    std::size_t mapped_ = 0;
+    std::size_t code_size_ = 0;
+    Function function_ = nullptr;
+    std::uint32_t registers_ = 0;
+    std::vector<std::uint32_t> slots_;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "flat_expression.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct NodeProfile {
+    std::uint32_t node;
+    OpCode op;
+    std::uint64_t calls;
+    // Time spent in the node itself, excluding its operands.
+    std::uint64_t self_nanoseconds;
+    // Self time of the node and of the nodes below it that it owns. A shared node is owned by
+    // the first parent that reads it, so it counts toward one path up to the root only.
+    std::uint64_t total_nanoseconds;
+    // Number of nodes the total covers, the node itself included.
+    std::uint32_t subtree_nodes;
+};
+
+struct OperatorProfile {
+    OpCode op;
+    std::uint64_t nodes;
+    std::uint64_t calls;
+    std::uint64_t nanoseconds;
+};
+
+struct ProfileStats {
+    std::size_t nodes;
+    std::size_t depth;
+    std::size_t bytes;
+    std::uint64_t evals;
+    std::uint64_t nanoseconds;
+    double evals_per_second;
+};
+
+// Instrumented evaluator: evaluates the expression node by node, as FlatExpression does, and
+// accumulates call counts and time per node. Clock reads around every node make an eval many
+// times slower than eval() on the expression, so the numbers are for comparing nodes and
+// operators with each other rather than for absolute timing.
+template<typename T>
+class ExpressionProfiler {
+public:
+    explicit ExpressionProfiler(const Expression<T>& expr);
+
+    T eval(const std::map<std::string, T>& context);
+    T eval(const EvalContext<T>& context);
+    void reset();
+
+    // By node index of the flat expression, operands before their parents.
+    std::vector<NodeProfile> nodes() const;
+    // One entry per operator present in the expression.
+    std::vector<OperatorProfile> operators() const;
+    ProfileStats stats() const;
+    // Subexpression of a node, cut to at most max_length characters.
+    std::string describe(std::uint32_t node, std::size_t max_length = 60) const;
+    // Human-readable summary: aggregate stats, time per operator and the top nodes by total time.
+    std::string report(std::size_t top = 10) const;
+private:
+    FlatExpression<T> flat_;
+    std::vector<T> values_;
+    std::vector<std::uint64_t> calls_;
+    std::vector<std::uint64_t> nanoseconds_;
+    std::size_t bytes_ = 0;
+    std::uint64_t evals_ = 0;
+    std::uint64_t total_ = 0;
+};
+
+#endif
@@ -0,0 +1,415 @@
+#pragma once
+#ifndef STATIC_EXPRESSION_HPP
+#define STATIC_EXPRESSION_HPP
+
+#include "expression.hpp"
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Expressions fixed at build time: "x * sin(y) + 2"_expr is parsed by the compiler with the
+// grammar of the runtime parser, and evaluating it instantiates one function per node, so the
+// whole formula inlines into straight-line code. Variables get compile-time indices in order
+// of first appearance; variables() lists their names.
+//
+// Number literals are rounded through long double, so a constant with more significant digits
+// than a long double holds can differ in its last bit from the runtime parser's value.
+//
+// A number followed by i ("2i") is an imaginary literal, as for the runtime parser of complex
+// expressions. A literal is parsed before any value type is chosen, so where
+// Expression<double>("2i") throws while parsing, evaluating "2i"_expr over a real type fails
+// to compile instead.
+
+template<std::size_t N>
+struct FixedString {
+    char text[N] = {};
+
+    consteval FixedString(const char (&literal)[N]) {
+        for (std::size_t i = 0; i < N; ++i) {
+            text[i] = literal[i];
+        }
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(text, N - 1);
+    }
+};
+
+// Same layout as FlatNode, but Variable nodes index the literal's own variable list.
+struct StaticNode {
+    OpCode op = OpCode::Value;
+    std::uint32_t lhs = 0;
+    std::uint32_t rhs = 0;
+};
+
+// Parsed literal, used as a template argument. Every member is public so the type is structural.
+// A character yields at most two nodes (unary minus becomes 0 - x), which bounds the arrays.
+template<std::size_t N>
+struct StaticProgram {
+    static constexpr std::size_t capacity = 2 * N + 1;
+
+    FixedString<N> source;
+    StaticNode nodes[capacity] = {};
+    std::uint32_t root = 0;
+    long double constants[capacity] = {};
+    // Whether each constant is the imaginary part of a literal like "2i".
+    bool imaginary[capacity] = {};
+    std::uint32_t constant_count = 0;
+    std::uint32_t name_start[capacity] = {};
+    std::uint32_t name_length[capacity] = {};
+    std::uint32_t variable_count = 0;
+    std::uint32_t node_count = 0;
+
+    consteval StaticProgram(const FixedString<N>& text) : source(text) {}
+};
+
+template<std::size_t N>
+class StaticParser {
+public:
+    consteval StaticParser(StaticProgram<N>& program) : program_(program), text_(program.source.view()) {}
+
+    consteval void parse() {
+        std::uint32_t result = parse_sum();
+        skip_spaces();
+        if (pos_ < text_.size()) {
+            if (text_[pos_] == ')') {
+                throw("parenthesis missmatch");
+            }
+            throw("unexpected character");
+        }
+        program_.root = result;
+    }
+private:
+    consteval std::uint32_t add(OpCode op, std::uint32_t lhs, std::uint32_t rhs = 0) {
+        program_.nodes[program_.node_count] = {op, lhs, rhs};
+        return program_.node_count++;
+    }
+
+    consteval std::uint32_t constant(long double value, bool imaginary = false) {
+        program_.constants[program_.constant_count] = value;
+        program_.imaginary[program_.constant_count] = imaginary;
+        return add(OpCode::Value, program_.constant_count++);
+    }
+
+    consteval std::uint32_t parse_sum() {
+        std::uint32_t result = parse_product();
+        while (true) {
+            if (accept('+')) {
+                result = add(OpCode::Add, result, parse_product());
+            } else if (accept('-')) {
+                result = add(OpCode::Sub, result, parse_product());
+            } else {
+                return result;
+            }
+        }
+    }
+
+    consteval std::uint32_t parse_product() {
+        std::uint32_t result = parse_unary();
+        while (true) {
+            if (accept('*')) {
+                result = add(OpCode::Mul, result, parse_unary());
+            } else if (accept('/')) {
+                result = add(OpCode::Div, result, parse_unary());
+            } else {
+                return result;
+            }
+        }
+    }
+
+    consteval std::uint32_t parse_unary() {
+        if (accept('-')) {
+            std::uint32_t zero = constant(0);
+            return add(OpCode::Sub, zero, parse_unary());
+        }
+        if (accept('+')) {
+            return parse_unary();
+        }
+        return parse_power();
+    }
+
+    consteval std::uint32_t parse_power() {
+        std::uint32_t base = parse_primary();
+        if (accept('^')) {
+            return add(OpCode::Pow, base, parse_unary());
+        }
+        return base;
+    }
+
+    consteval std::uint32_t parse_primary() {
+        skip_spaces();
+        if (pos_ == text_.size()) {
+            throw("unexpected end of expression");
+        }
+        char c = text_[pos_];
+        if (c == '(') {
+            ++pos_;
+            std::uint32_t inner = parse_sum();
+            if (!accept(')')) {
+                throw("parenthesis missmatch");
+            }
+            return inner;
+        }
+        if (is_digit(c) || c == '.') {
+            return parse_number();
+        }
+        if (!is_name_start(c)) {
+            throw("unexpected character");
+        }
+        std::size_t start = pos_;
+        while (pos_ < text_.size() && is_name_char(text_[pos_])) {
+            ++pos_;
+        }
+        std::string_view name = text_.substr(start, pos_ - start);
+        if (!accept('(')) {
+            return add(OpCode::Variable, variable(start, name));
+        }
+        std::uint32_t argument = parse_sum();
+        if (!accept(')')) {
+            throw("parenthesis missmatch");
+        }
+        if (name == "sin") {
+            return add(OpCode::Sin, argument);
+        }
+        if (name == "cos") {
+            return add(OpCode::Cos, argument);
+        }
+        if (name == "exp") {
+            return add(OpCode::Exp, argument);
+        }
+        if (name == "ln") {
+            return add(OpCode::Ln, argument);
+        }
+        throw("unknown function");
+    }
+
+    consteval std::uint32_t variable(std::size_t start, std::string_view name) {
+        for (std::uint32_t i = 0; i < program_.variable_count; ++i) {
+            if (text_.substr(program_.name_start[i], program_.name_length[i]) == name) {
+                return i;
+            }
+        }
+        program_.name_start[program_.variable_count] = static_cast<std::uint32_t>(start);
+        program_.name_length[program_.variable_count] = static_cast<std::uint32_t>(name.size());
+        return program_.variable_count++;
+    }
+
+    consteval std::uint32_t parse_number() {
+        long double mantissa = 0;
+        int scale = 0;
+        bool digits = false;
+        bool point = false;
+        while (pos_ < text_.size() && (is_digit(text_[pos_]) || text_[pos_] == '.')) {
+            if (text_[pos_] == '.') {
+                if (point) {
+                    throw("malformed number");
+                }
+                point = true;
+            } else {
+                mantissa = mantissa * 10 + (text_[pos_] - '0');
+                digits = true;
+                scale -= point ? 1 : 0;
+            }
+            ++pos_;
+        }
+        if (!digits) {
+            throw("malformed number");
+        }
+        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            std::size_t exponent = pos_ + 1;
+            bool negative = false;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                negative = text_[exponent] == '-';
+                ++exponent;
+            }
+            if (exponent < text_.size() && is_digit(text_[exponent])) {
+                int value = 0;
+                pos_ = exponent;
+                while (pos_ < text_.size() && is_digit(text_[pos_])) {
+                    value = value * 10 + (text_[pos_] - '0');
+                    ++pos_;
+                }
+                scale += negative ? -value : value;
+            }
+        }
+        bool imaginary = pos_ < text_.size() && text_[pos_] == 'i';
+        if (imaginary) {
+            ++pos_;
+        }
+        if (pos_ < text_.size() && is_name_char(text_[pos_])) {
+            throw("unexpected character");
+        }
+        long double power = 1;
+        long double base = 10;
+        for (int e = scale < 0 ? -scale : scale; e > 0; e >>= 1) {
+            if (e & 1) {
+                power *= base;
+            }
+            base *= base;
+        }
+        return constant(scale < 0 ? mantissa / power : mantissa * power, imaginary);
+    }
+
+    consteval void skip_spaces() {
+        while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            ++pos_;
+        }
+    }
+
+    consteval bool accept(char c) {
+        skip_spaces();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    static constexpr bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static constexpr bool is_name_start(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    static constexpr bool is_name_char(char c) {
+        return is_name_start(c) || is_digit(c);
+    }
+
+    StaticProgram<N>& program_;
+    std::string_view text_;
+    std::size_t pos_ = 0;
+};
+
+template<auto Program>
+class StaticExpression {
+public:
+    static constexpr std::size_t variable_count = Program.variable_count;
+
+    static constexpr std::string_view text() {
+        return Program.source.view();
+    }
+
+    static constexpr std::array<std::string_view, variable_count> variables() {
+        std::array<std::string_view, variable_count> names;
+        for (std::size_t i = 0; i < variable_count; ++i) {
+            names[i] = text().substr(Program.name_start[i], Program.name_length[i]);
+        }
+        return names;
+    }
+
+    // Values in the order of variables().
+    template<typename T>
+    T eval(const std::array<T, variable_count>& values) const {
+        return node<T, Program.root>(values.data());
+    }
+
+    template<typename T>
+    T eval(const EvalContext<T>& context) const {
+        static const std::array<std::uint32_t, variable_count> slots = [] {
+            std::array<std::uint32_t, variable_count> result;
+            for (std::size_t i = 0; i < variable_count; ++i) {
+                result[i] = SymbolTable::intern(std::string(variables()[i]));
+            }
+            return result;
+        }();
+        std::array<T, variable_count> values;
+        for (std::size_t i = 0; i < variable_count; ++i) {
+            if (!context.contains(slots[i])) {
+                throw("The variable \"" + std::string(variables()[i]) + "\" is undefined\n");
+            }
+            values[i] = context[slots[i]];
+        }
+        return eval(values);
+    }
+
+    template<typename T>
+    T eval(const std::map<std::string, T>& context) const {
+        std::array<T, variable_count> values;
+        for (std::size_t i = 0; i < variable_count; ++i) {
+            auto iter = context.find(std::string(variables()[i]));
+            if (iter == context.end()) {
+                throw("The variable \"" + std::string(variables()[i]) + "\" is undefined\n");
+            }
+            values[i] = iter->second;
+        }
+        return eval(values);
+    }
+
+    // Positional values, in the order of variables().
+    template<typename... Args>
+        requires (sizeof...(Args) == variable_count && variable_count > 0)
+    auto operator()(Args... args) const {
+        using T = std::common_type_t<Args...>;
+        return eval(std::array<T, variable_count>{static_cast<T>(args)...});
+    }
+
+    // The same formula as a runtime expression, e.g. to differentiate it.
+    template<typename T>
+    Expression<T> expression() const {
+        return Expression<T>(std::string(text()));
+    }
+private:
+    template<typename T, std::uint32_t I>
+    static T node(const T* values) {
+        using std::sin;
+        using std::cos;
+        using std::log;
+        using std::exp;
+        using std::pow;
+        constexpr StaticNode n = Program.nodes[I];
+        if constexpr (n.op == OpCode::Value && Program.imaginary[n.lhs]) {
+            static_assert(is_std_complex<T>::value, "an imaginary literal needs a complex value type");
+            if constexpr (is_std_complex<T>::value) {
+                return T(0, Program.constants[n.lhs]);
+            }
+        } else if constexpr (n.op == OpCode::Value) {
+            return T(Program.constants[n.lhs]);
+        } else if constexpr (n.op == OpCode::Variable) {
+            return values[n.lhs];
+        } else if constexpr (n.op == OpCode::Add) {
+            return node<T, n.lhs>(values) + node<T, n.rhs>(values);
+        } else if constexpr (n.op == OpCode::Sub) {
+            return node<T, n.lhs>(values) - node<T, n.rhs>(values);
+        } else if constexpr (n.op == OpCode::Mul) {
+            return node<T, n.lhs>(values) * node<T, n.rhs>(values);
+        } else if constexpr (n.op == OpCode::Div) {
+            T lhs = node<T, n.lhs>(values);
+            T rhs = node<T, n.rhs>(values);
+            if (rhs == T(0)) {
+                throw("Division by zero");
+            }
+            return lhs / rhs;
+        } else if constexpr (n.op == OpCode::Pow) {
+            return T(pow(node<T, n.lhs>(values), node<T, n.rhs>(values)));
+        } else if constexpr (n.op == OpCode::Sin) {
+            return T(sin(node<T, n.lhs>(values)));
+        } else if constexpr (n.op == OpCode::Cos) {
+            return T(cos(node<T, n.lhs>(values)));
+        } else if constexpr (n.op == OpCode::Ln) {
+            return T(log(node<T, n.lhs>(values)));
+        } else {
+            return T(exp(node<T, n.lhs>(values)));
+        }
+    }
+};
+
+template<std::size_t N>
+consteval StaticProgram<N> parse_static(const FixedString<N>& text) {
+    StaticProgram<N> program(text);
+    StaticParser<N>(program).parse();
+    return program;
+}
+
+template<FixedString Text>
+consteval auto operator""_expr() {
+    return StaticExpression<parse_static(Text)>{};
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers, each with its own deque of chunks. A worker drains its own deque
+// from the back and steals from the front of the others once it runs dry.
+class ThreadPool {
+public:
+    using Task = std::function<void(std::size_t chunk, std::size_t worker)>;
+
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency());
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    std::size_t size() const;
+    // Calls task(chunk, worker) for every chunk in [0, chunks) and blocks until all are done.
+    // worker is in [0, size()) and identifies the calling thread, e.g. to pick its scratch.
+    // The first exception thrown by a task is rethrown here; the remaining chunks are skipped.
+    void parallel_for(std::size_t chunks, const Task& task);
+private:
+    struct Item {
+        const Task* task;
+        std::size_t chunk;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+
+    void work(std::size_t worker);
+    bool take(std::size_t worker, Item& item);
+    void finish(std::exception_ptr error);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::size_t generation_ = 0;
+    std::size_t pending_ = 0;
+    std::exception_ptr error_;
+    bool stop_ = false;
+};
+
+#endif
@@ -0,0 +1,400 @@
+#include "expression.hpp"
+#include "thread_pool.hpp"
+#include <cmath>
+#include <string>
+#include <map>
+#include <vector>
+#include <type_traits>
+#include <algorithm>
+#include <complex>
+#include <limits>
+#include <atomic>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define EXPRESSION_PACKED_DOUBLE 1
+#endif
+
+namespace {
+
+#ifdef EXPRESSION_PACKED_DOUBLE
+// Packed double lanes. SSE2 is part of the baseline the whole file is compiled for; the AVX2
+// functions are compiled for that target alone, and binary_kernel only calls them once the
+// CPU has reported AVX2, so the same binary runs on CPUs without it.
+#define EXPRESSION_AVX2 __attribute__((target("avx2")))
+// packed_kernel is generic over the instruction set and always inlined into the AVX2 kernel,
+// so its AVX values never cross a call compiled without AVX. GCC warns about the AVX calling
+// convention where the template is written all the same, and reports it where the file ends.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+struct Sse2 {
+    using packed = __m128d;
+    static constexpr std::size_t lanes = 2;
+    static packed load(const double* p) { return _mm_loadu_pd(p); }
+    static void store(double* p, packed v) { _mm_storeu_pd(p, v); }
+    static packed add(packed a, packed b) { return _mm_add_pd(a, b); }
+    static packed sub(packed a, packed b) { return _mm_sub_pd(a, b); }
+    static packed mul(packed a, packed b) { return _mm_mul_pd(a, b); }
+    static packed div(packed a, packed b) { return _mm_div_pd(a, b); }
+    // Lane shuffles for interleaved complex values, one per register.
+    static packed swap_pairs(packed v) { return _mm_shuffle_pd(v, v, 1); }
+    static packed real_parts(packed v) { return _mm_unpacklo_pd(v, v); }
+    static packed imag_parts(packed v) { return _mm_unpackhi_pd(v, v); }
+    static packed negate_real(packed v) { return _mm_xor_pd(v, _mm_set_pd(0.0, -0.0)); }
+    static packed negate_imag(packed v) { return _mm_xor_pd(v, _mm_set_pd(-0.0, 0.0)); }
+    static bool all_between(packed v, double lo, double hi) {
+        packed inside = _mm_and_pd(_mm_cmpge_pd(v, _mm_set1_pd(lo)), _mm_cmple_pd(v, _mm_set1_pd(hi)));
+        return _mm_movemask_pd(inside) == 0b11;
+    }
+};
+
+struct Avx2 {
+    using packed = __m256d;
+    static constexpr std::size_t lanes = 4;
+    EXPRESSION_AVX2 static packed load(const double* p) { return _mm256_loadu_pd(p); }
+    EXPRESSION_AVX2 static void store(double* p, packed v) { _mm256_storeu_pd(p, v); }
+    EXPRESSION_AVX2 static packed add(packed a, packed b) { return _mm256_add_pd(a, b); }
+    EXPRESSION_AVX2 static packed sub(packed a, packed b) { return _mm256_sub_pd(a, b); }
+    EXPRESSION_AVX2 static packed mul(packed a, packed b) { return _mm256_mul_pd(a, b); }
+    EXPRESSION_AVX2 static packed div(packed a, packed b) { return _mm256_div_pd(a, b); }
+    // Two interleaved complex values per register.
+    EXPRESSION_AVX2 static packed swap_pairs(packed v) { return _mm256_permute_pd(v, 0b0101); }
+    EXPRESSION_AVX2 static packed real_parts(packed v) { return _mm256_movedup_pd(v); }
+    EXPRESSION_AVX2 static packed imag_parts(packed v) { return _mm256_permute_pd(v, 0b1111); }
+    EXPRESSION_AVX2 static packed negate_real(packed v) { return _mm256_xor_pd(v, _mm256_set_pd(0.0, -0.0, 0.0, -0.0)); }
+    EXPRESSION_AVX2 static packed negate_imag(packed v) { return _mm256_xor_pd(v, _mm256_set_pd(-0.0, 0.0, -0.0, 0.0)); }
+    EXPRESSION_AVX2 static bool all_between(packed v, double lo, double hi) {
+        packed inside = _mm256_and_pd(_mm256_cmp_pd(v, _mm256_set1_pd(lo), _CMP_GE_OQ), _mm256_cmp_pd(v, _mm256_set1_pd(hi), _CMP_LE_OQ));
+        return _mm256_movemask_pd(inside) == 0b1111;
+    }
+};
+
+BatchKernels detect_batch_kernels() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? BatchKernels::Avx2 : BatchKernels::Sse2;
+}
+#else
+BatchKernels detect_batch_kernels() {
+    return BatchKernels::Scalar;
+}
+#endif
+
+const BatchKernels supported_kernels = detect_batch_kernels();
+std::atomic<BatchKernels> current_kernels = supported_kernels;
+
+struct Add {
+    template<typename T>
+    static T apply(T a, T b) { return a + b; }
+};
+
+struct Sub {
+    template<typename T>
+    static T apply(T a, T b) { return a - b; }
+};
+
+struct Mul {
+    template<typename T>
+    static T apply(T a, T b) { return a * b; }
+};
+
+struct Div {
+    template<typename T>
+    static T apply(T a, T b) { return a / b; }
+};
+
+#ifdef EXPRESSION_PACKED_DOUBLE
+// Packed part of binary_kernel for double and std::complex<double>: handles a prefix of the n
+// elements and returns the index the scalar tail starts at. Always inlined into the kernel of
+// one instruction set, so its packed values only ever live in code compiled for that set.
+template<typename Isa, typename Op, typename T>
+[[gnu::always_inline]] inline std::size_t packed_kernel(const T* a, const T* b, T* out, std::size_t n) {
+    using packed = typename Isa::packed;
+    std::size_t i = 0;
+    if constexpr (std::is_same_v<T, double>) {
+        for (; i + Isa::lanes <= n; i += Isa::lanes) {
+            packed x = Isa::load(a + i);
+            packed y = Isa::load(b + i);
+            if constexpr (std::is_same_v<Op, Add>) {
+                Isa::store(out + i, Isa::add(x, y));
+            } else if constexpr (std::is_same_v<Op, Sub>) {
+                Isa::store(out + i, Isa::sub(x, y));
+            } else if constexpr (std::is_same_v<Op, Mul>) {
+                Isa::store(out + i, Isa::mul(x, y));
+            } else {
+                Isa::store(out + i, Isa::div(x, y));
+            }
+        }
+    } else if constexpr (std::is_same_v<T, std::complex<double>>) {
+        constexpr std::size_t pairs = Isa::lanes / 2;
+        for (; i + pairs <= n; i += pairs) {
+            packed x = Isa::load(reinterpret_cast<const double*>(a + i));
+            packed y = Isa::load(reinterpret_cast<const double*>(b + i));
+            packed norm;
+            if constexpr (std::is_same_v<Op, Div>) {
+                // a * conj(b) / |b|^2, only while |b|^2 is a normal number; outside that range
+                // the scaling std::complex applies is needed to avoid overflow and underflow.
+                packed squares = Isa::mul(y, y);
+                norm = Isa::add(squares, Isa::swap_pairs(squares));
+                if (!Isa::all_between(norm, std::numeric_limits<double>::min(), std::numeric_limits<double>::max())) {
+                    for (std::size_t j = i; j < i + pairs; ++j) {
+                        out[j] = a[j] / b[j];
+                    }
+                    continue;
+                }
+                y = Isa::negate_imag(y);
+            }
+            // (ar br - ai bi, ai br + ar bi), the same operations std::complex uses for finite values.
+            packed product = Isa::add(Isa::mul(x, Isa::real_parts(y)), Isa::negate_real(Isa::mul(Isa::swap_pairs(x), Isa::imag_parts(y))));
+            if constexpr (std::is_same_v<Op, Div>) {
+                product = Isa::div(product, norm);
+            }
+            Isa::store(reinterpret_cast<double*>(out + i), product);
+        }
+    }
+    return i;
+}
+
+template<typename Op, typename T>
+std::size_t packed_kernel_sse2(const T* a, const T* b, T* out, std::size_t n) {
+    return packed_kernel<Sse2, Op>(a, b, out, n);
+}
+
+template<typename Op, typename T>
+EXPRESSION_AVX2 std::size_t packed_kernel_avx2(const T* a, const T* b, T* out, std::size_t n) {
+    return packed_kernel<Avx2, Op>(a, b, out, n);
+}
+#endif
+
+template<typename Op, typename T>
+void binary_kernel(const T* a, const T* b, T* out, std::size_t n) {
+    if constexpr (is_std_complex<T>::value && (std::is_same_v<Op, Add> || std::is_same_v<Op, Sub>)) {
+        // Complex values are stored as (real, imag) pairs, so sums and differences are
+        // element-wise over twice as many scalars.
+        using R = typename T::value_type;
+        binary_kernel<Op>(reinterpret_cast<const R*>(a), reinterpret_cast<const R*>(b), reinterpret_cast<R*>(out), 2 * n);
+        return;
+    }
+    std::size_t i = 0;
+#ifdef EXPRESSION_PACKED_DOUBLE
+    if constexpr (std::is_same_v<T, double> || (std::is_same_v<T, std::complex<double>> && (std::is_same_v<Op, Mul> || std::is_same_v<Op, Div>))) {
+        switch (current_kernels.load(std::memory_order_relaxed)) {
+        case BatchKernels::Avx2:
+            i = packed_kernel_avx2<Op>(a, b, out, n);
+            break;
+        case BatchKernels::Sse2:
+            i = packed_kernel_sse2<Op>(a, b, out, n);
+            break;
+        case BatchKernels::Scalar:
+            break;
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = Op::apply(a[i], b[i]);
+    }
+}
+
+template<typename T>
+bool has_zero(const T* values, std::size_t n) {
+    bool zero = false;
+    for (std::size_t i = 0; i < n; ++i) {
+        zero |= values[i] == T(0);
+    }
+    return zero;
+}
+
+template<typename T, typename F>
+void unary_kernel(const T* a, T* out, std::size_t n, F f) {
+    for (std::size_t i = 0; i < n; ++i) {
+        out[i] = f(a[i]);
+    }
+}
+
+}
+
+BatchKernels batch_kernels() {
+    return current_kernels.load(std::memory_order_relaxed);
+}
+
+bool set_batch_kernels(BatchKernels kernels) {
+    if (kernels > supported_kernels) {
+        return false;
+    }
+    current_kernels.store(kernels, std::memory_order_relaxed);
+    return true;
+}
+
+template<typename T>
+std::size_t CompiledExpression<T>::batch_scratch_size() const {
+    return static_cast<std::size_t>(registers_) * batch_block;
+}
+
+template<typename T>
+void CompiledExpression<T>::check_columns(std::span<const T* const> columns) const {
+    for (std::uint32_t slot : slots_) {
+        if (slot >= columns.size() || columns[slot] == nullptr) {
+            throw("The variable \"" + SymbolTable::name(slot) + "\" is undefined\n");
+        }
+    }
+}
+
+template<typename T>
+std::size_t CompiledExpression<T>::batch_chunk_rows() const {
+    constexpr std::size_t cache_bytes = 256 * 1024;
+    std::size_t row_bytes = sizeof(T) * (slots_.size() + 1);
+    std::size_t blocks = std::max<std::size_t>(cache_bytes / row_bytes / batch_block, 1);
+    return blocks * batch_block;
+}
+
+template<typename T>
+std::vector<const T*> CompiledExpression<T>::columns_by_slot(const std::map<std::string, const T*>& columns) const {
+    std::vector<const T*> by_slot(SymbolTable::size(), nullptr);
+    for (const auto& [name, column] : columns) {
+        std::uint32_t slot = SymbolTable::find(name);
+        if (slot != SymbolTable::npos && slot < by_slot.size()) {
+            by_slot[slot] = column;
+        }
+    }
+    return by_slot;
+}
+
+template<typename T>
+void CompiledExpression<T>::eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out) const {
+    std::vector<const T*> by_slot = columns_by_slot(columns);
+    eval_batch(std::span<const T* const>(by_slot), n, out);
+}
+
+template<typename T>
+void CompiledExpression<T>::eval_batch(std::span<const T* const> columns, std::size_t n, T* out) const {
+    check_columns(columns);
+    std::vector<T> scratch(batch_scratch_size());
+    run_batch(columns.data(), 0, n, out, scratch.data());
+}
+
+template<typename T>
+void CompiledExpression<T>::eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out, ThreadPool& pool) const {
+    std::vector<const T*> by_slot = columns_by_slot(columns);
+    eval_batch(std::span<const T* const>(by_slot), n, out, pool);
+}
+
+template<typename T>
+void CompiledExpression<T>::eval_batch(std::span<const T* const> columns, std::size_t n, T* out, ThreadPool& pool) const {
+    check_columns(columns);
+    std::size_t rows = batch_chunk_rows();
+    std::size_t chunks = (n + rows - 1) / rows;
+    // Each chunk writes only its own rows of out, so placement does not depend on scheduling.
+    std::vector<std::vector<T>> scratch(pool.size());
+    pool.parallel_for(chunks, [&](std::size_t chunk, std::size_t worker) {
+        if (scratch[worker].empty()) {
+            scratch[worker].resize(batch_scratch_size());
+        }
+        std::size_t begin = chunk * rows;
+        std::size_t end = std::min(begin + rows, n);
+        run_batch(columns.data(), begin, end, out, scratch[worker].data());
+    });
+}
+
+template<typename T>
+void CompiledExpression<T>::run_batch(const T* const* columns, std::size_t begin, std::size_t end, T* out, T* scratch) const {
+    // Variables are read straight from their columns; every other register owns a block of scratch.
+    std::vector<const T*> source(registers_);
+    for (std::size_t base = begin; base < end; base += batch_block) {
+        std::size_t m = std::min(batch_block, end - base);
+        for (const Instruction& ins : code_) {
+            T* dst = scratch + static_cast<std::size_t>(ins.dst) * batch_block;
+            const T* a = nullptr;
+            const T* b = nullptr;
+            if (ins.op != OpCode::Value && ins.op != OpCode::Variable) {
+                a = source[ins.lhs];
+                b = source[ins.rhs];
+            }
+            switch (ins.op) {
+            case OpCode::Value:
+                std::fill(dst, dst + m, constants_[ins.lhs]);
+                break;
+            case OpCode::Variable:
+                source[ins.dst] = columns[ins.lhs] + base;
+                continue;
+            case OpCode::Add:
+                binary_kernel<Add>(a, b, dst, m);
+                break;
+            case OpCode::Sub:
+                binary_kernel<Sub>(a, b, dst, m);
+                break;
+            case OpCode::Mul:
+                binary_kernel<Mul>(a, b, dst, m);
+                break;
+            case OpCode::Div:
+                if (has_zero(b, m)) {
+                    throw("Division by zero");
+                }
+                binary_kernel<Div>(a, b, dst, m);
+                break;
+            case OpCode::Pow:
+                for (std::size_t i = 0; i < m; ++i) {
+                    dst[i] = std::pow(a[i], b[i]);
+                }
+                break;
+            case OpCode::Sin:
+                unary_kernel(a, dst, m, [](T x) { return std::sin(x); });
+                break;
+            case OpCode::Cos:
+                unary_kernel(a, dst, m, [](T x) { return std::cos(x); });
+                break;
+            case OpCode::Ln:
+                unary_kernel(a, dst, m, [](T x) { return std::log(x); });
+                break;
+            case OpCode::Exp:
+                unary_kernel(a, dst, m, [](T x) { return std::exp(x); });
+                break;
+            }
+            source[ins.dst] = dst;
+        }
+        std::copy(source[result_], source[result_] + m, out + base);
+    }
+}
+
+template std::size_t CompiledExpression<double>::batch_scratch_size() const;
+template std::size_t CompiledExpression<long double>::batch_scratch_size() const;
+template std::size_t CompiledExpression<int>::batch_scratch_size() const;
+template std::size_t CompiledExpression<std::complex<double>>::batch_scratch_size() const;
+template std::size_t CompiledExpression<std::complex<float>>::batch_scratch_size() const;
+template void CompiledExpression<double>::check_columns(std::span<const double* const>) const;
+template void CompiledExpression<long double>::check_columns(std::span<const long double* const>) const;
+template void CompiledExpression<int>::check_columns(std::span<const int* const>) const;
+template void CompiledExpression<std::complex<double>>::check_columns(std::span<const std::complex<double>* const>) const;
+template void CompiledExpression<std::complex<float>>::check_columns(std::span<const std::complex<float>* const>) const;
+template void CompiledExpression<double>::eval_batch(const std::map<std::string, const double*>&, std::size_t, double*) const;
+template void CompiledExpression<long double>::eval_batch(const std::map<std::string, const long double*>&, std::size_t, long double*) const;
+template void CompiledExpression<int>::eval_batch(const std::map<std::string, const int*>&, std::size_t, int*) const;
+template void CompiledExpression<std::complex<double>>::eval_batch(const std::map<std::string, const std::complex<double>*>&, std::size_t, std::complex<double>*) const;
+template void CompiledExpression<std::complex<float>>::eval_batch(const std::map<std::string, const std::complex<float>*>&, std::size_t, std::complex<float>*) const;
+template void CompiledExpression<double>::eval_batch(std::span<const double* const>, std::size_t, double*) const;
+template void CompiledExpression<long double>::eval_batch(std::span<const long double* const>, std::size_t, long double*) const;
+template void CompiledExpression<int>::eval_batch(std::span<const int* const>, std::size_t, int*) const;
+template void CompiledExpression<std::complex<double>>::eval_batch(std::span<const std::complex<double>* const>, std::size_t, std::complex<double>*) const;
+template void CompiledExpression<std::complex<float>>::eval_batch(std::span<const std::complex<float>* const>, std::size_t, std::complex<float>*) const;
+template void CompiledExpression<double>::run_batch(const double* const*, std::size_t, std::size_t, double*, double*) const;
+template void CompiledExpression<long double>::run_batch(const long double* const*, std::size_t, std::size_t, long double*, long double*) const;
+template void CompiledExpression<int>::run_batch(const int* const*, std::size_t, std::size_t, int*, int*) const;
+template void CompiledExpression<std::complex<double>>::run_batch(const std::complex<double>* const*, std::size_t, std::size_t, std::complex<double>*, std::complex<double>*) const;
+template void CompiledExpression<std::complex<float>>::run_batch(const std::complex<float>* const*, std::size_t, std::size_t, std::complex<float>*, std::complex<float>*) const;
+template std::size_t CompiledExpression<double>::batch_chunk_rows() const;
+template std::size_t CompiledExpression<long double>::batch_chunk_rows() const;
+template std::size_t CompiledExpression<int>::batch_chunk_rows() const;
+template std::size_t CompiledExpression<std::complex<double>>::batch_chunk_rows() const;
+template std::size_t CompiledExpression<std::complex<float>>::batch_chunk_rows() const;
+template std::vector<const double*> CompiledExpression<double>::columns_by_slot(const std::map<std::string, const double*>&) const;
+template std::vector<const long double*> CompiledExpression<long double>::columns_by_slot(const std::map<std::string, const long double*>&) const;
+template std::vector<const int*> CompiledExpression<int>::columns_by_slot(const std::map<std::string, const int*>&) const;
+template std::vector<const std::complex<double>*> CompiledExpression<std::complex<double>>::columns_by_slot(const std::map<std::string, const std::complex<double>*>&) const;
+template std::vector<const std::complex<float>*> CompiledExpression<std::complex<float>>::columns_by_slot(const std::map<std::string, const std::complex<float>*>&) const;
+template void CompiledExpression<double>::eval_batch(const std::map<std::string, const double*>&, std::size_t, double*, ThreadPool&) const;
+template void CompiledExpression<long double>::eval_batch(const std::map<std::string, const long double*>&, std::size_t, long double*, ThreadPool&) const;
+template void CompiledExpression<int>::eval_batch(const std::map<std::string, const int*>&, std::size_t, int*, ThreadPool&) const;
+template void CompiledExpression<std::complex<double>>::eval_batch(const std::map<std::string, const std::complex<double>*>&, std::size_t, std::complex<double>*, ThreadPool&) const;
+template void CompiledExpression<std::complex<float>>::eval_batch(const std::map<std::string, const std::complex<float>*>&, std::size_t, std::complex<float>*, ThreadPool&) const;
+template void CompiledExpression<double>::eval_batch(std::span<const double* const>, std::size_t, double*, ThreadPool&) const;
+template void CompiledExpression<long double>::eval_batch(std::span<const long double* const>, std::size_t, long double*, ThreadPool&) const;
+template void CompiledExpression<int>::eval_batch(std::span<const int* const>, std::size_t, int*, ThreadPool&) const;
+template void CompiledExpression<std::complex<double>>::eval_batch(std::span<const std::complex<double>* const>, std::size_t, std::complex<double>*, ThreadPool&) const;
+template void CompiledExpression<std::complex<float>>::eval_batch(std::span<const std::complex<float>* const>, std::size_t, std::complex<float>*, ThreadPool&) const;
@@ -1,15 +1,68 @@
 #include "expression.hpp"
+#include "expression_file.hpp"
+#include "profiler.hpp"
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <charconv>
+#include <algorithm>
+#include <exception>
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
 
-bool eval(int argc, char* argv[]){
+// With DIFFERENTIATOR_CACHE set to a directory, parsed expressions are kept there as
+// expression files named after a hash of their text and mapped instead of parsed next time.
+Expression<long double> load_expression_text(const std::string& text) {
+    const char* directory = std::getenv("DIFFERENTIATOR_CACHE");
+    if (!directory || !*directory) {
+        return Expression<long double>(text);
+    }
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (char c : text) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.expr", static_cast<unsigned long long>(hash));
+    std::string path = std::string(directory) + "/" + name;
+    try {
+        MappedExpression<long double> cached(path);
+        if (cached.source() == text) {
+            return cached.to_expression();
+        }
+    } catch (...) {
+    }
+    Expression<long double> parsed(text);
+    try {
+        save_expression_file(path, FlatExpression<long double>(parsed), text);
+    } catch (...) {
+    }
+    return parsed;
+}
+
+std::string describe(std::exception_ptr error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (const char* e) {
+        return e;
+    } catch (const std::string& e) {
+        return e;
+    } catch (const std::exception& e) {
+        return e.what();
+    } catch (...) {
+        return "Unknown error";
+    }
+}
+
+bool eval(int argc, char* argv[], bool profile){
     Expression<long double> x;
     std::string s = argv[2];
     try { 
-        x = Expression<long double>(s);
-    } catch (std::exception& e) {
-        std::cout << e.what() << std::endl;
+        x = load_expression_text(s);
+    } catch (...) {
+        std::cout << describe(std::current_exception()) << std::endl;
         return 1;
     }
     std::map <std::string, long double> context;
@@ -29,17 +82,32 @@ bool eval(int argc, char* argv[]){
         }
     }
     long double ans;
+    if (profile) {
+        // Repeats the evaluation for a fifth of a second so short expressions get stable numbers.
+        try {
+            ExpressionProfiler<long double> profiler(x);
+            auto start = std::chrono::steady_clock::now();
+            do {
+                ans = profiler.eval(context);
+            } while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(200));
+            std::cout << ans << "\n\n" << profiler.report();
+        } catch (...) {
+            std::cout << describe(std::current_exception()) << std::endl;
+            return 1;
+        }
+        return 0;
+    }
     try {
         ans = x.eval(context);
-    } catch (std::exception& e) {
-        std::cout << e.what() << std::endl;
+    } catch (...) {
+        std::cout << describe(std::current_exception()) << std::endl;
         return 1;
     }
     std::cout << ans << '\n';
     return 0;
 }
 
-bool diff(int argc, char* argv[]){
+bool diff(int argc, char* argv[], bool shared){
     if (argc != 5) {
         std::cout << "Correct command: differentiator diff <expression> by <variable>\n";
         return 1;
@@ -48,37 +116,206 @@ bool diff(int argc, char* argv[]){
     Expression<long double> x;
     std::string s = argv[2];
     try { 
-        x = Expression<long double>(s);
-    } catch (std::exception& e) {
-        std::cout << e.what() << std::endl;
+        x = load_expression_text(s);
+    } catch (...) {
+        std::cout << describe(std::current_exception()) << std::endl;
         return 1;
     }
     std::string q = argv[4];
     std::string ans;
     try {
-        ans = x.diff(argv[4]);
-    } catch (std::exception& e) {
-        std::cout << e.what() << std::endl;
+        ans = shared ? x.diff_shared(argv[4]) : x.diff(argv[4]);
+    } catch (...) {
+        std::cout << describe(std::current_exception()) << std::endl;
         return 1;
     }
     std::cout << ans << '\n';
     return 0;
 }
 
+void split(std::string_view line, char delimiter, std::vector<std::string_view>& fields) {
+    fields.clear();
+    while (true) {
+        std::size_t end = line.find(delimiter);
+        std::string_view field = line.substr(0, end);
+        while (!field.empty() && (field.front() == ' ' || field.front() == '\t')) {
+            field.remove_prefix(1);
+        }
+        while (!field.empty() && (field.back() == ' ' || field.back() == '\t')) {
+            field.remove_suffix(1);
+        }
+        fields.push_back(field);
+        if (end == std::string_view::npos) {
+            return;
+        }
+        line.remove_prefix(end + 1);
+    }
+}
+
+// Reads a header naming the variables and then one row of values per line (comma or tab
+// separated) from stdin, and writes one result per row. The expression is parsed and compiled
+// once; rows are evaluated in blocks through eval_batch and results printed in shortest
+// round-trip form.
+bool stream(int argc, char* argv[]){
+    if (argc != 3) {
+        std::cout << "Correct command: differentiator stream <expression> < rows.csv\n";
+        return 1;
+    }
+    CompiledExpression<long double> program;
+    try {
+        program = load_expression_text(argv[2]).compile();
+    } catch (...) {
+        std::cout << describe(std::current_exception()) << std::endl;
+        return 1;
+    }
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+    std::string line;
+    if (!std::getline(std::cin, line)) {
+        std::cout << "Missing header line\n";
+        return 1;
+    }
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    char delimiter = line.find('\t') != std::string::npos ? '\t' : ',';
+    std::vector<std::string_view> fields;
+    split(line, delimiter, fields);
+    std::size_t width = fields.size();
+    std::vector<std::uint32_t> column_slots(width);
+    for (std::size_t c = 0; c < width; ++c) {
+        column_slots[c] = SymbolTable::find(std::string(fields[c]));
+    }
+    for (std::uint32_t slot : program.slots()) {
+        if (std::find(column_slots.begin(), column_slots.end(), slot) == column_slots.end()) {
+            std::cout << "The variable \"" << SymbolTable::name(slot) << "\" has no column\n";
+            return 1;
+        }
+    }
+
+    constexpr std::size_t block_rows = 16 * CompiledExpression<long double>::batch_block;
+    std::vector<std::vector<long double>> columns(width, std::vector<long double>(block_rows));
+    std::vector<const long double*> by_slot(SymbolTable::size(), nullptr);
+    for (std::size_t c = 0; c < width; ++c) {
+        if (column_slots[c] != SymbolTable::npos) {
+            by_slot[column_slots[c]] = columns[c].data();
+        }
+    }
+    std::vector<long double> results(block_rows);
+    std::vector<std::size_t> row_lines(block_rows);
+    std::string out;
+    std::size_t rows = 0;
+
+    auto write = [&](std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            char buffer[64];
+            auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), results[i]);
+            out.append(buffer, end);
+            out.push_back('\n');
+        }
+        std::cout.write(out.data(), out.size());
+        out.clear();
+    };
+    // Evaluates the buffered rows; on a failure, prints the rows before the failing one
+    // and reports its line.
+    auto flush = [&]() {
+        try {
+            program.eval_batch(std::span<const long double* const>(by_slot), rows, results.data());
+        } catch (...) {
+            std::vector<long double> values(by_slot.size());
+            for (std::size_t i = 0; i < rows; ++i) {
+                for (std::size_t slot = 0; slot < by_slot.size(); ++slot) {
+                    values[slot] = by_slot[slot] ? by_slot[slot][i] : 0;
+                }
+                try {
+                    results[i] = program.eval(std::span<const long double>(values));
+                } catch (...) {
+                    write(i);
+                    std::cout << describe(std::current_exception()) << " in line " << row_lines[i] << std::endl;
+                    return false;
+                }
+            }
+        }
+        write(rows);
+        rows = 0;
+        return true;
+    };
+
+    std::size_t line_number = 1;
+    while (std::getline(std::cin, line)) {
+        ++line_number;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        split(line, delimiter, fields);
+        if (fields.size() != width) {
+            if (!flush()) {
+                return 1;
+            }
+            std::cout << "Expected " << width << " fields in line " << line_number << '\n';
+            return 1;
+        }
+        for (std::size_t c = 0; c < width; ++c) {
+            if (column_slots[c] == SymbolTable::npos) {
+                continue;
+            }
+            std::string_view field = fields[c];
+            const char* first = field.data();
+            if (!field.empty() && field.front() == '+') {
+                ++first;
+            }
+            auto [end, error] = std::from_chars(first, field.data() + field.size(), columns[c][rows]);
+            if (error != std::errc() || end != field.data() + field.size() || field.empty()) {
+                if (!flush()) {
+                    return 1;
+                }
+                std::cout << "Malformed number \"" << field << "\" in line " << line_number << '\n';
+                return 1;
+            }
+        }
+        row_lines[rows++] = line_number;
+        if (rows == block_rows && !flush()) {
+            return 1;
+        }
+    }
+    if (!flush()) {
+        return 1;
+    }
+    std::cout.flush();
+    return 0;
+}
+
 int main(int argc, char* argv[]){
-    
-    if (argc < 3 || (std::strcmp(argv[1], "eval") != 0 && std::strcmp(argv[1], "diff") != 0)) {
+    bool profile = argc > 1 && std::strcmp(argv[1], "--profile") == 0;
+    bool shared = argc > 1 && std::strcmp(argv[1], "--shared") == 0;
+    if (profile || shared) {
+        --argc;
+        ++argv;
+    }
+    if (argc < 3 || (std::strcmp(argv[1], "eval") != 0 && std::strcmp(argv[1], "diff") != 0 && std::strcmp(argv[1], "stream") != 0)
+        || (profile && std::strcmp(argv[1], "eval") != 0) || (shared && std::strcmp(argv[1], "diff") != 0)) {
         std::cout << "Correct command(diff): differentiator diff <expression> by <variable>\n";
+        std::cout << "Correct command(shared diff): differentiator --shared diff <expression> by <variable>\n";
         std::cout << "Correct command(eval): differentiator eval <expression>  <variable1>=<value1> <variable2>=<value2> ........\n";
+        std::cout << "Correct command(profile): differentiator --profile eval <expression>  <variable1>=<value1> ........\n";
+        std::cout << "Correct command(stream): differentiator stream <expression> < rows.csv\n";
         std::cout<<"smth went wrong\n";
         return 1;
+    } else if (std::strcmp(argv[1], "stream") == 0) {
+        if (stream(argc, argv)) {
+            std::cout<<"smth went wrong\n";
+            return 1;
+        }
     } else if (std::strcmp(argv[1], "eval") == 0) {
-        if (eval(argc, argv)) {
+        if (eval(argc, argv, profile)) {
             std::cout<<"smth went wrong\n";
             return 1;
         }
     } else {
-        if (diff(argc, argv)) {
+        if (diff(argc, argv, shared)) {
             std::cout<<"smth went wrong\n";
             return 1;
         }
@@ -7,12 +7,304 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <algorithm>
+#include <string_view>
+#include <charconv>
+#include <type_traits>
+#include <limits>
+#include <numbers>
+
+namespace {
+
+std::size_t hash_node(OpCode op, std::size_t lhs = 0, std::size_t rhs = 0) {
+    return hash_combine(hash_combine(std::hash<int>()(static_cast<int>(op)), lhs), rhs);
+}
+
+// Hash-consing table: every node is looked up here before it is handed out, so structurally
+// identical subtrees share one node. Entries are weak, so the table never keeps a node alive;
+// a node removes its own entry when it is destroyed, which also releases its control block
+// (and with it, for arena nodes, the arena's hold on its chunks).
+template<typename T>
+class NodeTable {
+public:
+    static NodeTable& instance() {
+        // Never destroyed: nodes held by other statics may still die after it at exit.
+        static NodeTable* table = new NodeTable;
+        return *table;
+    }
+
+    std::shared_ptr<ExpressionImpl<T>> intern(std::shared_ptr<ExpressionImpl<T>> node) {
+        std::size_t hash = node->hash();
+        Shard& shard = shards_[hash % shard_count];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto range = shard.nodes.equal_range(hash);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            std::shared_ptr<ExpressionImpl<T>> existing = iter->second.ref.lock();
+            if (existing && existing->same(*node)) {
+                return existing;
+            }
+        }
+        shard.nodes.emplace(hash, Entry{node.get(), node});
+        return node;
+    }
+
+    // Drops the entry of a node being destroyed, if it was interned.
+    void forget(std::size_t hash, const ExpressionImpl<T>* node) {
+        Shard& shard = shards_[hash % shard_count];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto range = shard.nodes.equal_range(hash);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second.node == node) {
+                shard.nodes.erase(iter);
+                return;
+            }
+        }
+    }
+private:
+    static constexpr std::size_t shard_count = 64;
+
+    struct Entry {
+        const ExpressionImpl<T>* node;
+        std::weak_ptr<ExpressionImpl<T>> ref;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_multimap<std::size_t, Entry> nodes;
+    };
+
+    std::array<Shard, shard_count> shards_;
+};
+
+template<typename T>
+std::shared_ptr<ExpressionImpl<T>> intern(std::shared_ptr<ExpressionImpl<T>> node) {
+    return NodeTable<T>::instance().intern(std::move(node));
+}
+
+}
+
+namespace {
+
+struct Symbols {
+    std::shared_mutex mutex;
+    std::unordered_map<std::string, std::uint32_t> slots;
+    std::deque<std::string> names;
+};
+
+Symbols& symbols() {
+    static Symbols table;
+    return table;
+}
+
+}
+
+std::uint32_t SymbolTable::intern(const std::string& name) {
+    Symbols& table = symbols();
+    {
+        std::shared_lock<std::shared_mutex> lock(table.mutex);
+        auto iter = table.slots.find(name);
+        if (iter != table.slots.end()) {
+            return iter->second;
+        }
+    }
+    std::unique_lock<std::shared_mutex> lock(table.mutex);
+    auto [iter, inserted] = table.slots.emplace(name, static_cast<std::uint32_t>(table.names.size()));
+    if (inserted) {
+        table.names.push_back(name);
+    }
+    return iter->second;
+}
+
+std::uint32_t SymbolTable::find(const std::string& name) {
+    Symbols& table = symbols();
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    auto iter = table.slots.find(name);
+    return iter == table.slots.end() ? npos : iter->second;
+}
+
+const std::string& SymbolTable::name(std::uint32_t slot) {
+    Symbols& table = symbols();
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    return table.names.at(slot);
+}
+
+std::uint32_t SymbolTable::size() {
+    Symbols& table = symbols();
+    std::shared_lock<std::shared_mutex> lock(table.mutex);
+    return static_cast<std::uint32_t>(table.names.size());
+}
+
+class ExpressionArena::Storage : public std::pmr::memory_resource {
+public:
+    explicit Storage(std::size_t chunk_bytes) : chunks_(chunk_bytes) {}
+
+    std::size_t allocated() const {
+        return allocated_;
+    }
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        allocated_ += bytes;
+        return chunks_.allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::monotonic_buffer_resource chunks_;
+    std::size_t allocated_ = 0;
+};
+
+namespace {
+
+thread_local ExpressionArena* current_arena = nullptr;
+
+// Allocator for allocate_shared: every control block carries a copy, so the arena's chunks stay
+// alive for as long as any node or weak reference still points into them.
+template<typename U>
+class ArenaAllocator {
+public:
+    using value_type = U;
+
+    explicit ArenaAllocator(std::shared_ptr<std::pmr::memory_resource> resource) : resource_(std::move(resource)) {}
+
+    template<typename V>
+    ArenaAllocator(const ArenaAllocator<V>& other) : resource_(other.resource_) {}
+
+    U* allocate(std::size_t n) {
+        return static_cast<U*>(resource_->allocate(n * sizeof(U), alignof(U)));
+    }
+
+    void deallocate(U* p, std::size_t n) {
+        resource_->deallocate(p, n * sizeof(U), alignof(U));
+    }
+
+    template<typename V>
+    bool operator==(const ArenaAllocator<V>& other) const {
+        return resource_ == other.resource_;
+    }
+private:
+    template<typename V>
+    friend class ArenaAllocator;
+
+    std::shared_ptr<std::pmr::memory_resource> resource_;
+};
+
+template<typename Node, typename... Args>
+std::shared_ptr<Node> make_node(Args&&... args) {
+    if (current_arena) {
+        return std::allocate_shared<Node>(ArenaAllocator<Node>(current_arena->resource()), std::forward<Args>(args)...);
+    }
+    return std::make_shared<Node>(std::forward<Args>(args)...);
+}
+
+}
+
+ExpressionArena::ExpressionArena(std::size_t chunk_bytes) : storage_(std::make_shared<Storage>(chunk_bytes)) {}
+
+ExpressionArena::Scope::Scope(ExpressionArena& arena) : previous_(current_arena) {
+    current_arena = &arena;
+}
+
+ExpressionArena::Scope::~Scope() {
+    current_arena = previous_;
+}
+
+ExpressionArena* ExpressionArena::current() {
+    return current_arena;
+}
+
+std::shared_ptr<std::pmr::memory_resource> ExpressionArena::resource() const {
+    return storage_;
+}
+
+std::size_t ExpressionArena::bytes_allocated() const {
+    return storage_->allocated();
+}
+
+template<typename T>
+EvalContext<T>::EvalContext(std::span<const T> values) : view_(values) {}
+
+template<typename T>
+EvalContext<T>::EvalContext(const std::map<std::string, T>& values) {
+    for (const auto& [name, value] : values) {
+        std::uint32_t slot = SymbolTable::find(name);
+        if (slot != SymbolTable::npos) {
+            set(slot, value);
+        }
+    }
+}
+
+template<typename T>
+EvalContext<T>::EvalContext(const EvalContext& copy) : values_(copy.values_), bound_(copy.bound_) {
+    view_ = copy.view_.data() == copy.values_.data() ? std::span<const T>(values_) : copy.view_;
+}
+
+template<typename T>
+EvalContext<T>& EvalContext<T>::operator=(const EvalContext& that) {
+    if (this == &that) {
+        return *this;
+    }
+    values_ = that.values_;
+    bound_ = that.bound_;
+    view_ = that.view_.data() == that.values_.data() ? std::span<const T>(values_) : that.view_;
+    return *this;
+}
+
+template<typename T>
+void EvalContext<T>::set(std::uint32_t slot, T value) {
+    if (slot >= values_.size()) {
+        values_.resize(slot + 1);
+        bound_.resize(slot + 1, 0);
+    }
+    values_[slot] = value;
+    bound_[slot] = 1;
+    view_ = values_;
+}
+
+template<typename T>
+void EvalContext<T>::set(const std::string& name, T value) {
+    set(SymbolTable::intern(name), value);
+}
+
+template<typename T>
+void EvalContext<T>::clear() {
+    std::fill(bound_.begin(), bound_.end(), 0);
+    view_ = values_;
+}
+
+template<typename T>
+bool EvalContext<T>::contains(std::uint32_t slot) const {
+    if (slot >= view_.size()) {
+        return false;
+    }
+    return view_.data() != values_.data() || bound_[slot];
+}
+
+template<typename T>
+T EvalContext<T>::operator[](std::uint32_t slot) const {
+    return view_[slot];
+}
+
+template<typename T>
+std::span<const T> EvalContext<T>::values() const {
+    return view_;
+}
 
 template<typename T>
 Expression<T>::Expression(std::shared_ptr<ExpressionImpl<T>> impl) : impl_(impl) {}
 
 template<typename T>
-Expression<T>::Expression(T val) : impl_(std::make_shared<Value<T>>(val)) {}
+Expression<T>::Expression(T val) : impl_(intern<T>(make_node<Value<T>>(val))) {}
 
 template<typename T>
 Expression<T>::Expression(const Expression& copy) : impl_(std::shared_ptr<ExpressionImpl<T>>(copy.impl_)) {}
@@ -22,6 +314,30 @@ Expression<T>::Expression(Expression&& moved) : impl_(std::move(moved.impl_)) {
     moved.impl_ = nullptr;
 }
 
+template<typename T>
+Expression<T>::~Expression() {
+    // Releasing a node releases its operands from inside its destructor, so a deep tree would
+    // recurse once per level. Operands released while a release is in progress are queued
+    // and dropped by the outermost destructor instead.
+    thread_local std::vector<std::shared_ptr<ExpressionImpl<T>>>* pending = nullptr;
+    if (!impl_) {
+        return;
+    }
+    if (pending) {
+        pending->push_back(std::move(impl_));
+        return;
+    }
+    std::vector<std::shared_ptr<ExpressionImpl<T>>> queue;
+    pending = &queue;
+    impl_.reset();
+    while (!queue.empty()) {
+        std::shared_ptr<ExpressionImpl<T>> node = std::move(queue.back());
+        queue.pop_back();
+        node.reset();
+    }
+    pending = nullptr;
+}
+
 template<typename T>
 Expression<T>& Expression<T>::operator= (const Expression<T>& that) {
     if (this == &that) {
@@ -42,8 +358,8 @@ Expression<T>& Expression<T>::operator= (Expression<T>&& that) {
 }
 
 template<typename T>
-Expression<T> Expression<T>::operator+ (const Expression<T>& that) {
-    return Expression<T>(std::make_shared<OperationAdd<T>>(*this, that));
+Expression<T> Expression<T>::operator+ (const Expression<T>& that) const {
+    return Expression<T>(intern<T>(make_node<OperationAdd<T>>(*this, that)));
 }
 
 template<typename T>
@@ -53,8 +369,8 @@ Expression<T>& Expression<T>::operator+=(const Expression<T>& that) {
 }
 
 template<typename T>
-Expression<T> Expression<T>::operator- (const Expression<T>& that) {
-    return Expression<T>(std::make_shared<OperationSub<T>>(*this, that));
+Expression<T> Expression<T>::operator- (const Expression<T>& that) const {
+    return Expression<T>(intern<T>(make_node<OperationSub<T>>(*this, that)));
 }
 
 template<typename T>
@@ -64,8 +380,8 @@ Expression<T>& Expression<T>::operator-=(const Expression<T>& that) {
 }
 
 template<typename T>
-Expression<T> Expression<T>::operator* (const Expression<T>& that) {
-    return Expression<T>(std::make_shared<OperationMul<T>>(*this, that));
+Expression<T> Expression<T>::operator* (const Expression<T>& that) const {
+    return Expression<T>(intern<T>(make_node<OperationMul<T>>(*this, that)));
 }
 
 template<typename T>
@@ -75,8 +391,8 @@ Expression<T>& Expression<T>::operator*=(const Expression<T>& that) {
 }
 
 template<typename T>
-Expression<T> Expression<T>::operator/ (const Expression<T>& that) {
-    return Expression<T>(std::make_shared<OperationDiv<T>>(*this, that));
+Expression<T> Expression<T>::operator/ (const Expression<T>& that) const {
+    return Expression<T>(intern<T>(make_node<OperationDiv<T>>(*this, that)));
 }
 
 template<typename T>
@@ -86,8 +402,8 @@ Expression<T>& Expression<T>::operator/=(const Expression<T>& that) {
 }
 
 template<typename T>
-Expression<T> Expression<T>::operator^ (const Expression<T>& that) {
-    return Expression<T>(std::make_shared<OperationPow<T>>(*this, that));
+Expression<T> Expression<T>::operator^ (const Expression<T>& that) const {
+    return Expression<T>(intern<T>(make_node<OperationPow<T>>(*this, that)));
 }
 
 template<typename T>
@@ -97,412 +413,2254 @@ Expression<T>& Expression<T>::operator^=(const Expression<T>& that) {
 }
 
 template<typename T>
-T Expression<T>::eval(std::map<std::string, T> context) const {
-    return impl_->eval(context);
+T Expression<T>::eval(const std::map<std::string, T>& context) const {
+    return eval(EvalContext<T>(context));
 }
 
+namespace {
+
+// Values of the shared nodes met during one Expression::eval on this thread, by node address.
+// Open addressing; entries left by earlier calls are told apart by their generation, so a call
+// starts without clearing anything and the table only allocates when it grows.
 template<typename T>
-std::string Expression<T>::to_string() const {
-    return impl_->to_string();
+class SharedValues {
+public:
+    void begin() {
+        if (++generation_ == 0) {
+            std::fill(entries_.begin(), entries_.end(), Entry{});
+            generation_ = 1;
+        }
+        size_ = 0;
+    }
+
+    const T* find(const void* node) const {
+        if (entries_.empty()) {
+            return nullptr;
+        }
+        for (std::size_t i = position(node);; i = (i + 1) & (entries_.size() - 1)) {
+            const Entry& entry = entries_[i];
+            if (entry.generation != generation_) {
+                return nullptr;
+            }
+            if (entry.node == node) {
+                return &entry.value;
+            }
+        }
+    }
+
+    void insert(const void* node, T value) {
+        if (2 * (size_ + 1) > entries_.size()) {
+            grow();
+        }
+        std::size_t i = position(node);
+        while (entries_[i].generation == generation_) {
+            i = (i + 1) & (entries_.size() - 1);
+        }
+        entries_[i] = {node, generation_, value};
+        ++size_;
+    }
+private:
+    struct Entry {
+        const void* node = nullptr;
+        std::uint32_t generation = 0;
+        T value{};
+    };
+
+    std::size_t position(const void* node) const {
+        std::uint64_t bits = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(node));
+        return static_cast<std::size_t>((bits * 0x9e3779b97f4a7c15ULL) >> 32) & (entries_.size() - 1);
+    }
+
+    void grow() {
+        std::vector<Entry> old(std::max<std::size_t>(2 * entries_.size(), 64));
+        old.swap(entries_);
+        size_ = 0;
+        for (const Entry& entry : old) {
+            if (entry.generation == generation_) {
+                insert(entry.node, entry.value);
+            }
+        }
+    }
+
+    std::vector<Entry> entries_;
+    std::uint32_t generation_ = 0;
+    std::size_t size_ = 0;
+};
+
 }
 
 template<typename T>
-std::string Expression<T>::diff(std::string var) const {
-    return impl_->diff(var);
+T Expression<T>::eval(const EvalContext<T>& context) const {
+    // Iterative post-order walk so deep trees do not exhaust the stack. Operand values are
+    // pushed on values left to right, and each node replaces its operands' values with its own.
+    // A node held by a single reference has one parent, so only nodes held more than once can
+    // be reached twice; their values are kept for the rest of the call. The scratch space is
+    // per thread and reused, so a call allocates only while it grows.
+    thread_local std::vector<std::pair<const Expression<T>*, bool>> stack;
+    thread_local std::vector<T> values;
+    thread_local SharedValues<T> shared;
+    stack.clear();
+    values.clear();
+    shared.begin();
+    stack.push_back({this, false});
+    while (!stack.empty()) {
+        auto [current, expanded] = stack.back();
+        const ExpressionImpl<T>* node = current->impl_.get();
+        bool is_shared = current->impl_.use_count() > 1;
+        const Expression<T>* lhs = node->operand(0);
+        const Expression<T>* rhs = node->operand(1);
+        if (!expanded && lhs) {
+            if (const T* value = is_shared ? shared.find(node) : nullptr) {
+                stack.pop_back();
+                values.push_back(*value);
+                continue;
+            }
+            stack.back().second = true;
+            if (rhs) {
+                stack.push_back({rhs, false});
+            }
+            stack.push_back({lhs, false});
+            continue;
+        }
+        stack.pop_back();
+        std::size_t arity = rhs ? 2 : lhs ? 1 : 0;
+        T value = node->eval(context, values.data() + values.size() - arity);
+        values.resize(values.size() - arity);
+        values.push_back(value);
+        if (is_shared && lhs) {
+            shared.insert(node, value);
+        }
+    }
+    return values.back();
 }
 
-template<typename V>
-Expression<V> sin(Expression<V> expr) {
-    return Expression<V>(std::make_shared<OperationSin<V>>(OperationSin<V>(expr)));
+template<typename T>
+T Expression<T>::eval(std::span<const T> values) const {
+    return eval(EvalContext<T>(values));
 }
 
-template<typename V>
-Expression<V> cos(Expression<V> expr) {
-    return Expression<V>(std::make_shared<OperationCos<V>>(OperationCos<V>(expr)));
+template<typename T>
+void Expression<T>::eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out) const {
+    compile().eval_batch(columns, n, out);
 }
 
-template<typename V>
-Expression<V> ln(Expression<V> expr) {
-    return Expression<V>(std::make_shared<OperationLn<V>>(expr));
+template<typename T>
+void Expression<T>::eval_batch(std::span<const T* const> columns, std::size_t n, T* out) const {
+    compile().eval_batch(columns, n, out);
 }
 
-template<typename V>
-Expression<V> exp(Expression<V> expr) {
-    return Expression<V>(std::make_shared<OperationExp<V>>(expr));
+template<typename T>
+void Expression<T>::eval_batch(const std::map<std::string, const T*>& columns, std::size_t n, T* out, ThreadPool& pool) const {
+    compile().eval_batch(columns, n, out, pool);
 }
 
 template<typename T>
-Value<T>::Value(T value) : value_(value) {}
+void Expression<T>::eval_batch(std::span<const T* const> columns, std::size_t n, T* out, ThreadPool& pool) const {
+    compile().eval_batch(columns, n, out, pool);
+}
+
+namespace {
 
+// Complex constants with a zero imaginary or real part have literals of their own ("2", "2i").
 template<typename T>
-T Value<T>::eval(std::map<std::string, T> context) const {
-    return value_;
+bool real_only(const T& value) {
+    return value.imag() == 0 && !std::signbit(value.imag());
 }
 
 template<typename T>
-struct is_std_complex_helper : std::false_type {};
+bool imaginary_only(const T& value) {
+    return !real_only(value) && value.real() == 0 && !std::signbit(value.real());
+}
 
 template<typename T>
-struct is_std_complex_helper<std::complex<T>> : std::true_type {};
+void write_number(std::string& out, const T& value, bool compact) {
+    if constexpr (is_std_complex<T>::value) {
+        if (!compact) {
+            out += '(';
+            write_number(out, value.real(), compact);
+            out += '+';
+            write_number(out, value.imag(), compact);
+            out += "i)";
+        } else if (real_only(value)) {
+            write_number(out, value.real(), compact);
+        } else if (imaginary_only(value)) {
+            write_number(out, value.imag(), compact);
+            out += 'i';
+        } else {
+            out += '(';
+            write_number(out, value.real(), compact);
+            out += std::signbit(value.imag()) ? " - " : " + ";
+            write_number(out, std::abs(value.imag()), compact);
+            out += "i)";
+        }
+    } else if (!compact) {
+        out += std::to_string(value);
+    } else {
+        char buffer[64];
+        auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        out.append(buffer, error == std::errc() ? end : buffer);
+    }
+}
 
-template<typename T>
-struct is_std_complex : is_std_complex_helper<std::remove_cv_t<std::remove_reference_t<T>>> {};
+// Binding strength of a node's printed form; a negative constant binds weakest because its
+// leading minus would otherwise be read as an operator.
+template<typename T>
+int precedence(const ExpressionImpl<T>* node) {
+    switch (node->op()) {
+    case OpCode::Add:
+    case OpCode::Sub:
+        return 1;
+    case OpCode::Mul:
+    case OpCode::Div:
+        return 2;
+    case OpCode::Pow:
+        return 3;
+    case OpCode::Value: {
+        T value = static_cast<const Value<T>*>(node)->value();
+        bool negative;
+        if constexpr (is_std_complex<T>::value) {
+            negative = real_only(value) ? std::signbit(value.real()) : imaginary_only(value) && std::signbit(value.imag());
+        } else {
+            negative = std::signbit(static_cast<long double>(value));
+        }
+        return negative ? 0 : 4;
+    }
+    default:
+        return 4;
+    }
+}
 
 template<typename T>
-std::string Value<T>::to_string() const {
-    if constexpr (is_std_complex<T>::value){
-        return "(" + std::to_string(value_.real())  + "+" + std::to_string(value_.imag()) + "i" + ")";
-    } else{
-        return std::to_string(value_);
+using TemporaryNames = std::unordered_map<const ExpressionImpl<T>*, std::string>;
+
+// Prints a tree with an explicit stack, appending each piece to out once, so the time is
+// linear in the length of the text whatever the depth. The legacy form wraps every binary
+// operation in parentheses; the compact one only where the grammar needs them, which keeps
+// the right operand of - and / and the left operand of ^ (right-associative) in parentheses
+// at equal precedence. Nodes below root found in names are printed as that name.
+// flush is called whenever out grows past 64 KiB. Writing stops once out holds limit
+// characters; the last piece written may run past it.
+template<typename T, typename Flush>
+void write_expression(std::string& out, const ExpressionImpl<T>* root, bool compact, Flush flush,
+                      const TemporaryNames<T>* names = nullptr, std::size_t limit = std::string::npos) {
+    auto named = [&](const ExpressionImpl<T>* node) -> const std::string* {
+        if (!names || node == root) {
+            return nullptr;
+        }
+        auto found = names->find(node);
+        return found == names->end() ? nullptr : &found->second;
+    };
+    auto binding = [&](const ExpressionImpl<T>* node) {
+        return named(node) ? 4 : precedence(node);
+    };
+    struct Item {
+        const ExpressionImpl<T>* node;
+        const char* text;
+        bool parenthesize;
+    };
+    static const char* const symbols[] = {" + ", " - ", " * ", " / ", " ^ "};
+    std::vector<Item> stack = {{root, nullptr, false}};
+    while (!stack.empty() && out.size() < limit) {
+        Item item = stack.back();
+        stack.pop_back();
+        if (!item.node) {
+            out += item.text;
+        } else if (const std::string* name = named(item.node)) {
+            out += *name;
+        } else {
+            const ExpressionImpl<T>* node = item.node;
+            switch (OpCode op = node->op()) {
+            case OpCode::Value:
+                if (item.parenthesize) {
+                    out += '(';
+                    write_number(out, static_cast<const Value<T>*>(node)->value(), compact);
+                    out += ')';
+                } else {
+                    write_number(out, static_cast<const Value<T>*>(node)->value(), compact);
+                }
+                break;
+            case OpCode::Variable:
+                out += static_cast<const Variable<T>*>(node)->name();
+                break;
+            case OpCode::Sin:
+            case OpCode::Cos:
+            case OpCode::Exp:
+            case OpCode::Ln:
+                out += op == OpCode::Sin ? "sin(" : op == OpCode::Cos ? "cos(" : op == OpCode::Exp ? "exp(" : "ln(";
+                stack.push_back({nullptr, ")", false});
+                stack.push_back({node->operand(0)->node(), nullptr, false});
+                break;
+            default: {
+                const ExpressionImpl<T>* left = node->operand(0)->node();
+                const ExpressionImpl<T>* right = node->operand(1)->node();
+                int own = precedence(node);
+                if (!compact || item.parenthesize) {
+                    out += '(';
+                    stack.push_back({nullptr, ")", false});
+                }
+                stack.push_back({right, nullptr, compact && (binding(right) < own || (binding(right) == own && op != OpCode::Pow))});
+                stack.push_back({nullptr, symbols[static_cast<int>(op) - static_cast<int>(OpCode::Add)], false});
+                stack.push_back({left, nullptr, compact && (binding(left) < own || (binding(left) == own && op == OpCode::Pow))});
+                break;
+            }
+            }
+        }
+        if (out.size() >= (std::size_t(1) << 16)) {
+            flush(out);
+        }
     }
 }
 
+}
+
 template<typename T>
-std::string Value<T>::diff(std::string var) const {
-    return "0";
+std::string ExpressionImpl<T>::to_string() const {
+    std::string out;
+    write_expression(out, this, false, [](std::string&) {});
+    return out;
 }
 
 template<typename T>
-Variable<T>::Variable(std::string name) : name_(name) {}
+std::string Expression<T>::to_string() const {
+    return impl_->to_string();
+}
 
 template<typename T>
-T Variable<T>::eval(std::map<std::string, T> context) const {
-    auto iter = context.find(name_);
-    if (iter == context.end()) { 
-        throw("The variable \"" + name_ + "\" is undefined\n");
-    }
-    return iter->second;
+std::string Expression<T>::to_string(std::size_t max_length) const {
+    std::string out;
+    write_expression<T>(out, impl_.get(), false, [](std::string&) {}, nullptr, max_length);
+    out.resize(std::min(out.size(), max_length));
+    return out;
 }
 
 template<typename T>
-std::string Variable<T>::to_string() const {
-    return name_;
+void Expression<T>::write_to(std::string& out) const {
+    write_expression(out, impl_.get(), true, [](std::string&) {});
 }
 
 template<typename T>
-std::string Variable<T>::diff(std::string var) const {   
-    if(var != name_){
-        return "0";
-    }
-    return "1";
+void Expression<T>::write_to(std::ostream& out) const {
+    std::string buffer;
+    auto flush = [&out](std::string& text) {
+        out.write(text.data(), static_cast<std::streamsize>(text.size()));
+        text.clear();
+    };
+    write_expression(buffer, impl_.get(), true, flush);
+    flush(buffer);
 }
 
 template<typename T>
-OperationAdd<T>::OperationAdd(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {}
+std::ostream& operator<<(std::ostream& out, const Expression<T>& expr) {
+    expr.write_to(out);
+    return out;
+}
 
 template<typename T>
-T OperationAdd<T>::eval(std::map<std::string, T> context) const {
-    T value_left  = left_.eval(context);
-    T value_right = right_.eval(context);
-    return value_left + value_right;
+void Expression<T>::write_shared(std::string& out, std::string_view result) const {
+    // Orders the nodes operands first and counts the distinct parents of each.
+    std::unordered_map<const ExpressionImpl<T>*, std::uint32_t> uses;
+    std::unordered_set<const ExpressionImpl<T>*> visited;
+    std::vector<const ExpressionImpl<T>*> order;
+    std::vector<std::pair<const ExpressionImpl<T>*, bool>> stack = {{node(), false}};
+    while (!stack.empty()) {
+        auto [current, expanded] = stack.back();
+        stack.pop_back();
+        if (expanded) {
+            order.push_back(current);
+            continue;
+        }
+        if (!visited.insert(current).second) {
+            continue;
+        }
+        stack.push_back({current, true});
+        for (std::size_t i = 0; const Expression<T>* child = current->operand(i); ++i) {
+            ++uses[child->node()];
+            stack.push_back({child->node(), false});
+        }
+    }
+    std::unordered_set<std::string> taken;
+    for (const ExpressionImpl<T>* current : order) {
+        if (current->op() == OpCode::Variable) {
+            taken.insert(static_cast<const Variable<T>*>(current)->name());
+        }
+    }
+    auto nothing = [](std::string&) {};
+    TemporaryNames<T> names;
+    std::size_t next = 1;
+    for (const ExpressionImpl<T>* current : order) {
+        if (current == node() || current->op() == OpCode::Value || current->op() == OpCode::Variable || uses[current] < 2) {
+            continue;
+        }
+        std::string name;
+        do {
+            name = "t" + std::to_string(next++);
+        } while (taken.contains(name));
+        out += name;
+        out += " = ";
+        write_expression(out, current, true, nothing, &names);
+        out += "; ";
+        names.emplace(current, std::move(name));
+    }
+    out += result;
+    out += " = ";
+    write_expression(out, node(), true, nothing, &names);
 }
 
 template<typename T>
-std::string OperationAdd<T>::to_string() const {
-    return "("   + left_.to_string()  + " + " + right_.to_string() + ")";
+std::string Expression<T>::diff(std::string var) const {
+    return derivative(var).to_string();
 }
 
 template<typename T>
-std::string OperationAdd<T>::diff(std::string var) const {   
-    return "("   + left_.diff(var)  + " + " + right_.diff(var) + ")";
+std::string Expression<T>::diff_shared(std::string var) const {
+    std::string out;
+    derivative(var).write_shared(out);
+    return out;
 }
 
 template<typename T>
-OperationSub<T>::OperationSub(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {}
+Expression<T> Expression<T>::derivative(const std::string& var) const {
+    return derivative(SymbolTable::find(var));
+}
 
 template<typename T>
-T OperationSub<T>::eval(std::map<std::string, T> context) const {
-    return left_.eval(context) - right_.eval(context);
+Expression<T> Expression<T>::derivative(std::uint32_t slot) const {
+    // Iterative post-order walk so deep trees do not exhaust the stack; a shared node is
+    // differentiated once and its derivative shared by every parent, so the work is linear
+    // in the number of distinct nodes.
+    struct Done {
+        Expression<T> derivative;
+        bool depends;
+    };
+    std::unordered_map<const ExpressionImpl<T>*, Done> done;
+    std::vector<std::pair<const ExpressionImpl<T>*, bool>> stack = {{impl_.get(), false}};
+    while (!stack.empty()) {
+        auto [node, expanded] = stack.back();
+        if (done.count(node)) {
+            stack.pop_back();
+            continue;
+        }
+        if (!expanded) {
+            stack.back().second = true;
+            for (std::size_t i = 0; const Expression<T>* child = node->operand(i); ++i) {
+                if (!done.count(child->node())) {
+                    stack.push_back({child->node(), false});
+                }
+            }
+            continue;
+        }
+        stack.pop_back();
+        OperandDerivatives<T> operands = {slot, {nullptr, nullptr}, {false, false}};
+        bool depends = node->op() == OpCode::Variable && static_cast<const Variable<T>*>(node)->slot() == slot;
+        for (std::size_t i = 0; const Expression<T>* child = node->operand(i); ++i) {
+            const Done& operand = done.at(child->node());
+            operands.derivative[i] = &operand.derivative;
+            operands.depends[i] = operand.depends;
+            depends = depends || operand.depends;
+        }
+        done.emplace(node, Done{node->derivative(operands), depends});
+    }
+    return done.at(impl_.get()).derivative;
 }
 
 template<typename T>
-std::string OperationSub<T>::to_string() const {
-    return "("   + left_.to_string()  + " - " + right_.to_string() + ")";
+bool Expression<T>::depends_on(std::uint32_t slot) const {
+    std::unordered_set<const ExpressionImpl<T>*> seen;
+    std::vector<const ExpressionImpl<T>*> stack = {impl_.get()};
+    while (!stack.empty()) {
+        const ExpressionImpl<T>* node = stack.back();
+        stack.pop_back();
+        if (!seen.insert(node).second) {
+            continue;
+        }
+        if (node->op() == OpCode::Variable && static_cast<const Variable<T>*>(node)->slot() == slot) {
+            return true;
+        }
+        for (std::size_t i = 0; const Expression<T>* child = node->operand(i); ++i) {
+            stack.push_back(child->node());
+        }
+    }
+    return false;
 }
 
 template<typename T>
-std::string OperationSub<T>::diff(std::string var) const {
-    return "("   + left_.diff(var)  + " - " + right_.diff(var) + ")";
+Expression<T> ExpressionImpl<T>::self() const {
+    return Expression<T>(std::const_pointer_cast<ExpressionImpl<T>>(this->shared_from_this()));
 }
 
 template<typename T>
-OperationMul<T>::OperationMul(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {}
+CompiledExpression<T> Expression<T>::compile() const {
+    // Iterative post-order walk, operands left to right as the registers are handed out, so
+    // deep trees do not exhaust the stack; a shared node is emitted once and then read from
+    // its register.
+    ProgramBuilder<T> builder;
+    builder.count_uses(*this);
+    std::uint32_t reg = 0;
+    std::vector<std::pair<const ExpressionImpl<T>*, bool>> stack = {{impl_.get(), false}};
+    while (!stack.empty()) {
+        auto [node, expanded] = stack.back();
+        if (builder.lookup(node, reg)) {
+            stack.pop_back();
+            continue;
+        }
+        const Expression<T>* lhs = node->operand(0);
+        const Expression<T>* rhs = node->operand(1);
+        if (!expanded) {
+            stack.back().second = true;
+            if (rhs) {
+                stack.push_back({rhs->node(), false});
+            }
+            if (lhs) {
+                stack.push_back({lhs->node(), false});
+            }
+            continue;
+        }
+        stack.pop_back();
+        if (node->op() == OpCode::Value) {
+            reg = builder.emit_value(static_cast<const Value<T>*>(node)->value());
+        } else if (node->op() == OpCode::Variable) {
+            reg = builder.emit_variable(static_cast<const Variable<T>*>(node)->slot());
+        } else {
+            std::uint32_t a = 0;
+            std::uint32_t b = 0;
+            builder.lookup(lhs->node(), a);
+            if (rhs) {
+                builder.lookup(rhs->node(), b);
+            }
+            reg = builder.emit(node->op(), a, b);
+        }
+        builder.remember(node, reg);
+    }
+    builder.lookup(impl_.get(), reg);
+    return builder.finish(reg);
+}
 
 template<typename T>
-T OperationMul<T>::eval(std::map<std::string, T> context) const {
-    return left_.eval(context) * right_.eval(context);
+Dual<T> Expression<T>::eval_with_derivative(const std::map<std::string, T>& context, const std::string& var) const {
+    return eval_with_derivative(EvalContext<T>(context), var);
 }
 
 template<typename T>
-std::string OperationMul<T>::to_string() const {
-    return "("   + left_.to_string()  + " * " + right_.to_string() + ")";
+Dual<T> Expression<T>::eval_with_derivative(const EvalContext<T>& context, const std::string& var) const {
+    return compile().eval_with_derivative(context, SymbolTable::find(var));
 }
 
 template<typename T>
-std::string OperationMul<T>::diff(std::string var) const {
-    return "("   + left_.to_string() + " * "  + right_.diff(var)   +
-           " + " + left_.diff(var)  + " * " + right_.to_string()  + ")";
+Gradient<T> Expression<T>::eval_gradient(const std::map<std::string, T>& context) const {
+    return eval_gradient(EvalContext<T>(context));
 }
 
 template<typename T>
-OperationDiv<T>::OperationDiv(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {}
+Gradient<T> Expression<T>::eval_gradient(const EvalContext<T>& context) const {
+    return compile().eval_gradient(context);
+}
 
 template<typename T>
-T OperationDiv<T>::eval(std::map<std::string, T> context) const {
-    T r = right_.eval(context);
-    if(r == 0) {
-        throw("Division by zero");
-    }
-    return left_.eval(context) / right_.eval(context);
+Interval<T> Expression<T>::eval_interval(const std::map<std::string, Interval<T>>& ranges) const
+    requires (!is_std_complex<T>::value) {
+    return compile().eval_interval(ranges);
 }
 
 template<typename T>
-std::string OperationDiv<T>::to_string() const {
-    return "("   + left_.to_string()  + " / " + right_.to_string() + ")";
+const ExpressionImpl<T>* Expression<T>::node() const {
+    return impl_.get();
 }
 
 template<typename T>
-std::string OperationDiv<T>::diff(std::string var) const {   
-    return "((" + left_.diff(var) + " * "  + right_.to_string()   +
-           " - " + left_.to_string()  + " * " + right_.diff(var)  +
-           ") / (" + right_.to_string() +  " ^ 2))";
+std::size_t Expression<T>::hash() const {
+    return impl_ ? impl_->hash() : 0;
 }
 
 template<typename T>
-OperationPow<T>::OperationPow(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {}
+bool Expression<T>::operator==(const Expression<T>& that) const {
+    return impl_ == that.impl_;
+}
 
 template<typename T>
-T OperationPow<T>::eval(std::map<std::string, T> context) const {
-    return std::pow(left_.eval(context), right_.eval(context));
+ExpressionImpl<T>::~ExpressionImpl() {
+    NodeTable<T>::instance().forget(hash_, this);
 }
 
 template<typename T>
-std::string OperationPow<T>::to_string() const {
-    return "("   + left_.to_string()  + " ^ " + right_.to_string() + ")";
+std::size_t ExpressionImpl<T>::hash() const {
+    return hash_;
+}
+
+template<typename V>
+Expression<V> sin(Expression<V> expr) {
+    return Expression<V>(intern<V>(make_node<OperationSin<V>>(expr)));
+}
+
+template<typename V>
+Expression<V> cos(Expression<V> expr) {
+    return Expression<V>(intern<V>(make_node<OperationCos<V>>(expr)));
+}
+
+template<typename V>
+Expression<V> ln(Expression<V> expr) {
+    return Expression<V>(intern<V>(make_node<OperationLn<V>>(expr)));
+}
+
+template<typename V>
+Expression<V> exp(Expression<V> expr) {
+    return Expression<V>(intern<V>(make_node<OperationExp<V>>(expr)));
 }
 
 template<typename T>
-std::string OperationPow<T>::diff(std::string var) const {   
-    Expression nw = right_;
-    nw = nw - Expression<T>(1.0);
-    return "(" + right_.to_string() +  " * (" + left_.to_string() + 
-           " ^ " + nw.to_string() + ") * " + left_.diff(var) + ")";
+Value<T>::Value(T value) : value_(value) {
+    this->hash_ = hash_node(OpCode::Value, hash_constant(value_));
 }
 
 template<typename T>
-OperationSin<T>::OperationSin(Expression<T> variable) : expr_  (variable) {}
+T Value<T>::eval(const EvalContext<T>&, const T*) const {
+    return value_;
+}
 
 template<typename T>
-T OperationSin<T>::eval(std::map<std::string, T> context) const {
-    return std::sin(expr_.eval(context));
+Expression<T> Value<T>::derivative(const OperandDerivatives<T>&) const {
+    return Expression<T>(T(0));
 }
 
 template<typename T>
-std::string OperationSin<T>::to_string() const {
-    return "sin(" + expr_.to_string()  + ")";
+T Value<T>::value() const {
+    return value_;
 }
 
 template<typename T>
-std::string OperationSin<T>::diff(std::string var) const {   
-    return "(cos(" + expr_.to_string() + ") * " + expr_.diff(var)+ ")";
+OpCode Value<T>::op() const {
+    return OpCode::Value;
 }
 
 template<typename T>
-OperationCos<T>::OperationCos(Expression<T> variable) : expr_  (variable) {}
+const Expression<T>* Value<T>::operand(std::size_t) const {
+    return nullptr;
+}
 
 template<typename T>
-T OperationCos<T>::eval(std::map<std::string, T> context) const {
-    return std::cos(expr_.eval(context));
+bool Value<T>::same(const ExpressionImpl<T>& other) const {
+    return other.op() == OpCode::Value && same_constant(value_, static_cast<const Value<T>&>(other).value_);
 }
 
 template<typename T>
-std::string OperationCos<T>::to_string() const {
-    return "cos(" + expr_.to_string()  + ")";
+Variable<T>::Variable(std::string name) : name_(name), slot_(SymbolTable::intern(name_)) {
+    this->hash_ = hash_node(OpCode::Variable, slot_);
 }
 
 template<typename T>
-std::string OperationCos<T>::diff(std::string var) const {   
-    return "(-sin(" + expr_.to_string() + ") * " + expr_.diff(var)+ ")";
+T Variable<T>::eval(const EvalContext<T>& context, const T*) const {
+    if (!context.contains(slot_)) {
+        throw("The variable \"" + name_ + "\" is undefined\n");
+    }
+    return context[slot_];
 }
 
 template<typename T>
-OperationExp<T>::OperationExp(Expression<T> variable) : expr_  (variable) {}
+Expression<T> Variable<T>::derivative(const OperandDerivatives<T>& operands) const {
+    return Expression<T>(T(operands.slot == slot_ ? 1 : 0));
+}
 
 template<typename T>
-T OperationExp<T>::eval(std::map<std::string, T> context) const {
-    return std::exp(expr_.eval(context));
+const std::string& Variable<T>::name() const {
+    return name_;
 }
 
 template<typename T>
-std::string OperationExp<T>::to_string() const {
-    return "exp(" + expr_.to_string()  + ")";
+std::uint32_t Variable<T>::slot() const {
+    return slot_;
 }
 
 template<typename T>
-std::string OperationExp<T>::diff(std::string var) const {   
-    return "(exp(" + expr_.to_string() + ") * " + expr_.diff(var) + ")";
+OpCode Variable<T>::op() const {
+    return OpCode::Variable;
 }
 
 template<typename T>
-OperationLn<T>::OperationLn(Expression<T> variable) : expr_  (variable) {}
+const Expression<T>* Variable<T>::operand(std::size_t) const {
+    return nullptr;
+}
 
 template<typename T>
-T OperationLn<T>::eval(std::map<std::string, T> context) const {
-    return std::log(expr_.eval(context));
+bool Variable<T>::same(const ExpressionImpl<T>& other) const {
+    return other.op() == OpCode::Variable && slot_ == static_cast<const Variable<T>&>(other).slot_;
 }
 
 template<typename T>
-std::string OperationLn<T>::to_string() const {
-    return "ln(" + expr_.to_string() + ")";
+OperationAdd<T>::OperationAdd(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {
+    this->hash_ = hash_node(OpCode::Add, left_.hash(), right_.hash());
 }
 
 template<typename T>
-std::string OperationLn<T>::diff(std::string var) const {   
-    return "(" + expr_.diff(var) + "/" + expr_.to_string() + ")";
+T OperationAdd<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return operands[0] + operands[1];
 }
 
 template<typename T>
-Expression<T>::Expression(std::string variable) {
-    while(variable.find(' ') < variable.size()){
-        variable.replace(variable.find(' '), 1, "");
+Expression<T> OperationAdd<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    const Expression<T>& dv = *operands.derivative[1];
+    return du + dv;
+}
+
+template<typename T>
+OpCode OperationAdd<T>::op() const {
+    return OpCode::Add;
+}
+
+template<typename T>
+const Expression<T>* OperationAdd<T>::operand(std::size_t index) const {
+    return index == 0 ? &left_ : index == 1 ? &right_ : nullptr;
+}
+
+template<typename T>
+bool OperationAdd<T>::same(const ExpressionImpl<T>& other) const {
+    if (other.op() != OpCode::Add) {
+        return false;
+    }
+    const OperationAdd<T>& that = static_cast<const OperationAdd<T>&>(other);
+    return left_ == that.left_ && right_ == that.right_;
+}
+
+template<typename T>
+OperationSub<T>::OperationSub(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {
+    this->hash_ = hash_node(OpCode::Sub, left_.hash(), right_.hash());
+}
+
+template<typename T>
+T OperationSub<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return operands[0] - operands[1];
+}
+
+template<typename T>
+Expression<T> OperationSub<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    const Expression<T>& dv = *operands.derivative[1];
+    return du - dv;
+}
+
+template<typename T>
+OpCode OperationSub<T>::op() const {
+    return OpCode::Sub;
+}
+
+template<typename T>
+const Expression<T>* OperationSub<T>::operand(std::size_t index) const {
+    return index == 0 ? &left_ : index == 1 ? &right_ : nullptr;
+}
+
+template<typename T>
+bool OperationSub<T>::same(const ExpressionImpl<T>& other) const {
+    if (other.op() != OpCode::Sub) {
+        return false;
+    }
+    const OperationSub<T>& that = static_cast<const OperationSub<T>&>(other);
+    return left_ == that.left_ && right_ == that.right_;
+}
+
+template<typename T>
+OperationMul<T>::OperationMul(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {
+    this->hash_ = hash_node(OpCode::Mul, left_.hash(), right_.hash());
+}
+
+template<typename T>
+T OperationMul<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return operands[0] * operands[1];
+}
+
+template<typename T>
+Expression<T> OperationMul<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    const Expression<T>& dv = *operands.derivative[1];
+    return left_ * dv + du * right_;
+}
+
+template<typename T>
+OpCode OperationMul<T>::op() const {
+    return OpCode::Mul;
+}
+
+template<typename T>
+const Expression<T>* OperationMul<T>::operand(std::size_t index) const {
+    return index == 0 ? &left_ : index == 1 ? &right_ : nullptr;
+}
+
+template<typename T>
+bool OperationMul<T>::same(const ExpressionImpl<T>& other) const {
+    if (other.op() != OpCode::Mul) {
+        return false;
+    }
+    const OperationMul<T>& that = static_cast<const OperationMul<T>&>(other);
+    return left_ == that.left_ && right_ == that.right_;
+}
+
+template<typename T>
+OperationDiv<T>::OperationDiv(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {
+    this->hash_ = hash_node(OpCode::Div, left_.hash(), right_.hash());
+}
+
+template<typename T>
+T OperationDiv<T>::eval(const EvalContext<T>&, const T* operands) const {
+    if (operands[1] == T(0)) {
+        throw("Division by zero");
+    }
+    return operands[0] / operands[1];
+}
+
+template<typename T>
+Expression<T> OperationDiv<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    const Expression<T>& dv = *operands.derivative[1];
+    return (du * right_ - left_ * dv) / (right_ ^ Expression<T>(T(2)));
+}
+
+template<typename T>
+OpCode OperationDiv<T>::op() const {
+    return OpCode::Div;
+}
+
+template<typename T>
+const Expression<T>* OperationDiv<T>::operand(std::size_t index) const {
+    return index == 0 ? &left_ : index == 1 ? &right_ : nullptr;
+}
+
+template<typename T>
+bool OperationDiv<T>::same(const ExpressionImpl<T>& other) const {
+    if (other.op() != OpCode::Div) {
+        return false;
+    }
+    const OperationDiv<T>& that = static_cast<const OperationDiv<T>&>(other);
+    return left_ == that.left_ && right_ == that.right_;
+}
+
+template<typename T>
+OperationPow<T>::OperationPow(Expression<T> left, Expression<T> right) : left_  (left), right_ (right) {
+    this->hash_ = hash_node(OpCode::Pow, left_.hash(), right_.hash());
+}
+
+template<typename T>
+T OperationPow<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return std::pow(operands[0], operands[1]);
+}
+
+template<typename T>
+Expression<T> OperationPow<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    const Expression<T>& dv = *operands.derivative[1];
+    if (!operands.depends[1]) {
+        return right_ * (left_ ^ (right_ - Expression<T>(T(1)))) * du;
+    }
+    // d(u^v) = u^v * (v' ln u + v u' / u) once the exponent varies too.
+    return this->self() * (dv * ln(left_) + right_ * du / left_);
+}
+
+template<typename T>
+OpCode OperationPow<T>::op() const {
+    return OpCode::Pow;
+}
+
+template<typename T>
+const Expression<T>* OperationPow<T>::operand(std::size_t index) const {
+    return index == 0 ? &left_ : index == 1 ? &right_ : nullptr;
+}
+
+template<typename T>
+bool OperationPow<T>::same(const ExpressionImpl<T>& other) const {
+    if (other.op() != OpCode::Pow) {
+        return false;
+    }
+    const OperationPow<T>& that = static_cast<const OperationPow<T>&>(other);
+    return left_ == that.left_ && right_ == that.right_;
+}
+
+template<typename T>
+OperationSin<T>::OperationSin(Expression<T> variable) : expr_  (variable) {
+    this->hash_ = hash_node(OpCode::Sin, expr_.hash());
+}
+
+template<typename T>
+T OperationSin<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return std::sin(operands[0]);
+}
+
+template<typename T>
+Expression<T> OperationSin<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    return cos(expr_) * du;
+}
+
+template<typename T>
+OpCode OperationSin<T>::op() const {
+    return OpCode::Sin;
+}
+
+template<typename T>
+const Expression<T>* OperationSin<T>::operand(std::size_t index) const {
+    return index == 0 ? &expr_ : nullptr;
+}
+
+template<typename T>
+bool OperationSin<T>::same(const ExpressionImpl<T>& other) const {
+    return other.op() == OpCode::Sin && expr_ == static_cast<const OperationSin<T>&>(other).expr_;
+}
+
+template<typename T>
+OperationCos<T>::OperationCos(Expression<T> variable) : expr_  (variable) {
+    this->hash_ = hash_node(OpCode::Cos, expr_.hash());
+}
+
+template<typename T>
+T OperationCos<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return std::cos(operands[0]);
+}
+
+template<typename T>
+Expression<T> OperationCos<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    return (Expression<T>(T(0)) - sin(expr_)) * du;
+}
+
+template<typename T>
+OpCode OperationCos<T>::op() const {
+    return OpCode::Cos;
+}
+
+template<typename T>
+const Expression<T>* OperationCos<T>::operand(std::size_t index) const {
+    return index == 0 ? &expr_ : nullptr;
+}
+
+template<typename T>
+bool OperationCos<T>::same(const ExpressionImpl<T>& other) const {
+    return other.op() == OpCode::Cos && expr_ == static_cast<const OperationCos<T>&>(other).expr_;
+}
+
+template<typename T>
+OperationExp<T>::OperationExp(Expression<T> variable) : expr_  (variable) {
+    this->hash_ = hash_node(OpCode::Exp, expr_.hash());
+}
+
+template<typename T>
+T OperationExp<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return std::exp(operands[0]);
+}
+
+template<typename T>
+Expression<T> OperationExp<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    return this->self() * du;
+}
+
+template<typename T>
+OpCode OperationExp<T>::op() const {
+    return OpCode::Exp;
+}
+
+template<typename T>
+const Expression<T>* OperationExp<T>::operand(std::size_t index) const {
+    return index == 0 ? &expr_ : nullptr;
+}
+
+template<typename T>
+bool OperationExp<T>::same(const ExpressionImpl<T>& other) const {
+    return other.op() == OpCode::Exp && expr_ == static_cast<const OperationExp<T>&>(other).expr_;
+}
+
+template<typename T>
+OperationLn<T>::OperationLn(Expression<T> variable) : expr_  (variable) {
+    this->hash_ = hash_node(OpCode::Ln, expr_.hash());
+}
+
+template<typename T>
+T OperationLn<T>::eval(const EvalContext<T>&, const T* operands) const {
+    return std::log(operands[0]);
+}
+
+template<typename T>
+Expression<T> OperationLn<T>::derivative(const OperandDerivatives<T>& operands) const {
+    const Expression<T>& du = *operands.derivative[0];
+    return du / expr_;
+}
+
+template<typename T>
+OpCode OperationLn<T>::op() const {
+    return OpCode::Ln;
+}
+
+template<typename T>
+const Expression<T>* OperationLn<T>::operand(std::size_t index) const {
+    return index == 0 ? &expr_ : nullptr;
+}
+
+template<typename T>
+bool OperationLn<T>::same(const ExpressionImpl<T>& other) const {
+    return other.op() == OpCode::Ln && expr_ == static_cast<const OperationLn<T>&>(other).expr_;
+}
+
+template<typename T>
+T CompiledExpression<T>::eval(const std::map<std::string, T>& context) const {
+    return eval(EvalContext<T>(context));
+}
+
+// Dual number arithmetic used when a compiled program runs over Dual<T>.
+template<typename T>
+Dual<T> operator+(Dual<T> a, Dual<T> b) {
+    return {T(a.value + b.value), T(a.derivative + b.derivative)};
+}
+
+template<typename T>
+Dual<T> operator-(Dual<T> a, Dual<T> b) {
+    return {T(a.value - b.value), T(a.derivative - b.derivative)};
+}
+
+template<typename T>
+Dual<T> operator*(Dual<T> a, Dual<T> b) {
+    return {T(a.value * b.value), T(a.derivative * b.value + a.value * b.derivative)};
+}
+
+template<typename T>
+Dual<T> operator/(Dual<T> a, Dual<T> b) {
+    return {T(a.value / b.value), T((a.derivative * b.value - a.value * b.derivative) / (b.value * b.value))};
+}
+
+template<typename T>
+Dual<T> pow(Dual<T> a, Dual<T> b) {
+    T value = T(std::pow(a.value, b.value));
+    if (b.derivative == T(0)) {
+        return {value, T(b.value * std::pow(a.value, b.value - T(1)) * a.derivative)};
+    }
+    return {value, T(value * (b.derivative * std::log(a.value) + b.value * a.derivative / a.value))};
+}
+
+template<typename T>
+Dual<T> sin(Dual<T> a) {
+    return {T(std::sin(a.value)), T(std::cos(a.value) * a.derivative)};
+}
+
+template<typename T>
+Dual<T> cos(Dual<T> a) {
+    return {T(std::cos(a.value)), T(-std::sin(a.value) * a.derivative)};
+}
+
+template<typename T>
+Dual<T> exp(Dual<T> a) {
+    T value = T(std::exp(a.value));
+    return {value, T(value * a.derivative)};
+}
+
+template<typename T>
+Dual<T> log(Dual<T> a) {
+    return {T(std::log(a.value)), T(a.derivative / a.value)};
+}
+
+template<typename T>
+Interval<T>::Interval(T point) : lo(point), hi(point) {}
+
+template<typename T>
+Interval<T>::Interval(T lo, T hi) : lo(lo), hi(hi) {}
+
+template<typename T>
+bool Interval<T>::contains(T value) const {
+    return lo <= value && value <= hi;
+}
+
+namespace {
+
+// Interval bounds are computed in floating point, double for int, and then rounded outwards:
+// by one ulp after + - * / and by two after library functions, which may be off by one.
+template<typename T>
+using Wide = std::conditional_t<std::is_integral_v<T>, double, T>;
+
+template<typename T>
+T lower(Wide<T> x, int steps = 1) {
+    if constexpr (std::is_integral_v<T>) {
+        x = std::floor(x);
+        return x > Wide<T>(std::numeric_limits<T>::min()) && x < Wide<T>(std::numeric_limits<T>::max()) ? T(x)
+               : x >= Wide<T>(std::numeric_limits<T>::max()) ? std::numeric_limits<T>::max() : std::numeric_limits<T>::min();
+    } else {
+        for (int i = 0; i < steps; ++i) {
+            x = std::nextafter(x, -std::numeric_limits<T>::infinity());
+        }
+        return x;
+    }
+}
+
+template<typename T>
+T upper(Wide<T> x, int steps = 1) {
+    if constexpr (std::is_integral_v<T>) {
+        x = std::ceil(x);
+        return x > Wide<T>(std::numeric_limits<T>::min()) && x < Wide<T>(std::numeric_limits<T>::max()) ? T(x)
+               : x <= Wide<T>(std::numeric_limits<T>::min()) ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+    } else {
+        for (int i = 0; i < steps; ++i) {
+            x = std::nextafter(x, std::numeric_limits<T>::infinity());
+        }
+        return x;
+    }
+}
+
+template<typename T>
+Interval<T> whole_line() {
+    return {lower<T>(-std::numeric_limits<Wide<T>>::infinity()), upper<T>(std::numeric_limits<Wide<T>>::infinity())};
+}
+
+// Result of ln or pow with the whole range outside their domain.
+template<typename T>
+Interval<T> undefined() {
+    if constexpr (std::is_integral_v<T>) {
+        return whole_line<T>();
+    } else {
+        return {std::numeric_limits<T>::quiet_NaN(), std::numeric_limits<T>::quiet_NaN()};
+    }
+}
+
+// Product in which zero times an infinite bound is zero, as it is for the reals the bounds stand for.
+template<typename W>
+W bound_product(W a, W b) {
+    return a == W(0) || b == W(0) ? W(0) : a * b;
+}
+
+// sin or cos over a range shorter than a period: the values at the ends, widened to 1 or -1
+// when the range contains a maximum or minimum. The extremes sit at shift + k * pi, maxima
+// for even k.
+template<typename T>
+Interval<T> periodic(Interval<T> a, bool cosine) {
+    using W = Wide<T>;
+    constexpr W pi = std::numbers::pi_v<W>;
+    W lo = a.lo;
+    W hi = a.hi;
+    if (!(hi - lo < 2 * pi)) {
+        return {T(-1), T(1)};
+    }
+    W at_lo = cosine ? std::cos(lo) : std::sin(lo);
+    W at_hi = cosine ? std::cos(hi) : std::sin(hi);
+    W min = std::min(at_lo, at_hi);
+    W max = std::max(at_lo, at_hi);
+    W shift = cosine ? W(0) : pi / 2;
+    for (W k = std::ceil((lo - shift) / pi); shift + k * pi <= hi; k += 1) {
+        if (std::fmod(k, W(2)) == W(0)) {
+            max = 1;
+        } else {
+            min = -1;
+        }
+    }
+    return {std::max(lower<T>(min, 2), T(-1)), std::min(upper<T>(max, 2), T(1))};
+}
+
+}
+
+// Interval arithmetic used when a compiled program runs over Interval<T>.
+template<typename T>
+Interval<T> operator+(Interval<T> a, Interval<T> b) {
+    return {lower<T>(Wide<T>(a.lo) + Wide<T>(b.lo)), upper<T>(Wide<T>(a.hi) + Wide<T>(b.hi))};
+}
+
+template<typename T>
+Interval<T> operator-(Interval<T> a, Interval<T> b) {
+    return {lower<T>(Wide<T>(a.lo) - Wide<T>(b.hi)), upper<T>(Wide<T>(a.hi) - Wide<T>(b.lo))};
+}
+
+template<typename T>
+Interval<T> operator*(Interval<T> a, Interval<T> b) {
+    using W = Wide<T>;
+    W products[] = {bound_product<W>(a.lo, b.lo), bound_product<W>(a.lo, b.hi), bound_product<W>(a.hi, b.lo),
+                    bound_product<W>(a.hi, b.hi)};
+    return {lower<T>(*std::min_element(products, products + 4)), upper<T>(*std::max_element(products, products + 4))};
+}
+
+template<typename T>
+Interval<T> operator/(Interval<T> a, Interval<T> b) {
+    using W = Wide<T>;
+    constexpr W infinity = std::numeric_limits<W>::infinity();
+    if (a.lo == T(0) && a.hi == T(0)) {
+        return {T(0), T(0)};
+    }
+    if (b.lo > T(0) || b.hi < T(0)) {
+        W quotients[] = {W(a.lo) / W(b.lo), W(a.lo) / W(b.hi), W(a.hi) / W(b.lo), W(a.hi) / W(b.hi)};
+        return {lower<T>(*std::min_element(quotients, quotients + 4)), upper<T>(*std::max_element(quotients, quotients + 4))};
+    }
+    // The divisor touches zero, so the quotient is unbounded on at least one side.
+    if (b.lo == T(0) && b.hi > T(0)) {
+        if (a.lo >= T(0)) {
+            return {lower<T>(W(a.lo) / W(b.hi)), upper<T>(infinity)};
+        }
+        if (a.hi <= T(0)) {
+            return {lower<T>(-infinity), upper<T>(W(a.hi) / W(b.hi))};
+        }
+    } else if (b.hi == T(0) && b.lo < T(0)) {
+        if (a.lo >= T(0)) {
+            return {lower<T>(-infinity), upper<T>(W(a.lo) / W(b.lo))};
+        }
+        if (a.hi <= T(0)) {
+            return {lower<T>(W(a.hi) / W(b.lo)), upper<T>(infinity)};
+        }
+    }
+    return whole_line<T>();
+}
+
+template<typename T>
+Interval<T> pow(Interval<T> a, Interval<T> b) {
+    using std::pow;
+    using W = Wide<T>;
+    W n = b.lo;
+    if (b.lo == b.hi && std::isfinite(n) && std::trunc(n) == n) {
+        // Integer exponent: defined for negative bases, odd powers increasing and even ones
+        // with their minimum at zero.
+        if (n == W(0)) {
+            return {T(1), T(1)};
+        }
+        W m = std::abs(n);
+        W at_lo = pow(W(a.lo), m);
+        W at_hi = pow(W(a.hi), m);
+        Interval<T> power;
+        if (std::fmod(m, W(2)) != W(0) || a.lo >= T(0)) {
+            power = {lower<T>(at_lo, 2), upper<T>(at_hi, 2)};
+        } else if (a.hi <= T(0)) {
+            power = {lower<T>(at_hi, 2), upper<T>(at_lo, 2)};
+        } else {
+            power = {T(0), upper<T>(std::max(at_lo, at_hi), 2)};
+        }
+        return n > W(0) ? power : Interval<T>(T(1)) / power;
+    }
+    if (!(a.hi >= T(0))) {
+        return undefined<T>();
+    }
+    // x ^ y is monotonic in each argument for x >= 0, so its extremes over the box are at the corners.
+    W lo = std::max(W(a.lo), W(0));
+    W corners[] = {pow(lo, W(b.lo)), pow(lo, W(b.hi)), pow(W(a.hi), W(b.lo)), pow(W(a.hi), W(b.hi))};
+    return {lower<T>(*std::min_element(corners, corners + 4), 2), upper<T>(*std::max_element(corners, corners + 4), 2)};
+}
+
+template<typename T>
+Interval<T> sin(Interval<T> a) {
+    return periodic(a, false);
+}
+
+template<typename T>
+Interval<T> cos(Interval<T> a) {
+    return periodic(a, true);
+}
+
+template<typename T>
+Interval<T> exp(Interval<T> a) {
+    return {lower<T>(std::exp(Wide<T>(a.lo)), 2), upper<T>(std::exp(Wide<T>(a.hi)), 2)};
+}
+
+template<typename T>
+Interval<T> log(Interval<T> a) {
+    if (!(a.hi >= T(0))) {
+        return undefined<T>();
+    }
+    return {lower<T>(std::log(std::max(Wide<T>(a.lo), Wide<T>(0))), 2), upper<T>(std::log(Wide<T>(a.hi)), 2)};
+}
+
+namespace {
+
+template<typename T>
+bool divides_by_zero(T value) {
+    return value == T(0);
+}
+
+template<typename T>
+bool divides_by_zero(Dual<T> value) {
+    return value.value == T(0);
+}
+
+// Interval division handles zero divisors itself.
+template<typename T>
+bool divides_by_zero(Interval<T>) {
+    return false;
+}
+
+// A constant of the program as a value of the type it runs over; a dual constant has derivative 0.
+template<typename S, typename T>
+S lift_constant(T value) {
+    if constexpr (std::is_same_v<S, Dual<T>>) {
+        return {value, T(0)};
+    } else {
+        return S(value);
     }
-    int depth = 0;
-    for(int i = 0; i < variable.size(); ++i){
-        if(variable[i] == '('){
-            depth++;
-            continue;
+}
+
+}
+
+template<typename T>
+void CompiledExpression<T>::check_bound(const EvalContext<T>& context) const {
+    for (std::uint32_t slot : slots_) {
+        if (!context.contains(slot)) {
+            throw("The variable \"" + SymbolTable::name(slot) + "\" is undefined\n");
         }
-        if(variable[i] == ')'){
-            depth--;
-            continue;
+    }
+}
+
+template<typename T>
+T CompiledExpression<T>::eval(const EvalContext<T>& context) const {
+    check_bound(context);
+    constexpr std::uint32_t inline_registers = 64;
+    if (registers_ <= inline_registers) {
+        std::array<T, inline_registers> registers;
+        return run(context.values().data(), registers.data());
+    }
+    std::vector<T> registers(registers_);
+    return run(context.values().data(), registers.data());
+}
+
+template<typename T>
+T CompiledExpression<T>::eval(std::span<const T> values) const {
+    return eval(EvalContext<T>(values));
+}
+
+template<typename T>
+template<typename S>
+S CompiledExpression<T>::execute(const S* variables, S* r) const {
+    using std::sin;
+    using std::cos;
+    using std::log;
+    using std::exp;
+    using std::pow;
+    const T* constants = constants_.data();
+    for (const Instruction& ins : code_) {
+        switch (ins.op) {
+        case OpCode::Value:
+            r[ins.dst] = lift_constant<S>(constants[ins.lhs]);
+            break;
+        case OpCode::Variable:
+            r[ins.dst] = variables[ins.lhs];
+            break;
+        case OpCode::Add:
+            r[ins.dst] = r[ins.lhs] + r[ins.rhs];
+            break;
+        case OpCode::Sub:
+            r[ins.dst] = r[ins.lhs] - r[ins.rhs];
+            break;
+        case OpCode::Mul:
+            r[ins.dst] = r[ins.lhs] * r[ins.rhs];
+            break;
+        case OpCode::Div:
+            if (divides_by_zero(r[ins.rhs])) {
+                throw("Division by zero");
+            }
+            r[ins.dst] = r[ins.lhs] / r[ins.rhs];
+            break;
+        case OpCode::Pow:
+            r[ins.dst] = pow(r[ins.lhs], r[ins.rhs]);
+            break;
+        case OpCode::Sin:
+            r[ins.dst] = sin(r[ins.lhs]);
+            break;
+        case OpCode::Cos:
+            r[ins.dst] = cos(r[ins.lhs]);
+            break;
+        case OpCode::Ln:
+            r[ins.dst] = log(r[ins.lhs]);
+            break;
+        case OpCode::Exp:
+            r[ins.dst] = exp(r[ins.lhs]);
+            break;
+        }
+    }
+    return r[result_];
+}
+
+template<typename T>
+T CompiledExpression<T>::run(const T* variables, T* registers) const {
+    return execute(variables, registers);
+}
+
+template<typename T>
+Dual<T> CompiledExpression<T>::eval_dual(std::span<const Dual<T>> variables) const {
+    for (std::uint32_t slot : slots_) {
+        if (slot >= variables.size()) {
+            throw("The variable \"" + SymbolTable::name(slot) + "\" is undefined\n");
+        }
+    }
+    std::vector<Dual<T>> registers(registers_);
+    return execute(variables.data(), registers.data());
+}
+
+template<typename T>
+Interval<T> CompiledExpression<T>::eval_interval(std::span<const Interval<T>> variables) const
+    requires (!is_std_complex<T>::value) {
+    for (std::uint32_t slot : slots_) {
+        if (slot >= variables.size()) {
+            throw("The variable \"" + SymbolTable::name(slot) + "\" is undefined\n");
+        }
+    }
+    std::vector<Interval<T>> registers(registers_);
+    return execute(variables.data(), registers.data());
+}
+
+template<typename T>
+Interval<T> CompiledExpression<T>::eval_interval(const std::map<std::string, Interval<T>>& ranges) const
+    requires (!is_std_complex<T>::value) {
+    std::vector<Interval<T>> variables(SymbolTable::size());
+    std::vector<unsigned char> bound(variables.size(), 0);
+    for (const auto& [name, range] : ranges) {
+        std::uint32_t slot = SymbolTable::find(name);
+        if (slot < variables.size()) {
+            variables[slot] = range;
+            bound[slot] = 1;
+        }
+    }
+    for (std::uint32_t slot : slots_) {
+        if (!bound[slot]) {
+            throw("The variable \"" + SymbolTable::name(slot) + "\" is undefined\n");
+        }
+    }
+    return eval_interval(variables);
+}
+
+template<typename T>
+Dual<T> CompiledExpression<T>::eval_with_derivative(const EvalContext<T>& context, std::uint32_t slot) const {
+    check_bound(context);
+    std::span<const T> values = context.values();
+    std::vector<Dual<T>> variables(values.size());
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        variables[i] = {values[i], T(i == slot ? 1 : 0)};
+    }
+    return eval_dual(variables);
+}
+
+template<typename T>
+Gradient<T> CompiledExpression<T>::eval_gradient(const EvalContext<T>& context) const {
+    check_bound(context);
+    const T* variables = context.values().data();
+    std::size_t n = code_.size();
+    // Registers are recycled, so first map every operand register to the instruction that wrote it
+    // and keep each instruction's value on a tape.
+    std::vector<std::uint32_t> writer(registers_);
+    std::vector<std::uint32_t> lhs(n);
+    std::vector<std::uint32_t> rhs(n);
+    std::vector<unsigned char> varying(n);
+    std::vector<T> v(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        const Instruction& ins = code_[i];
+        if (ins.op != OpCode::Value && ins.op != OpCode::Variable) {
+            lhs[i] = writer[ins.lhs];
+            rhs[i] = writer[ins.rhs];
+        }
+        switch (ins.op) {
+        case OpCode::Value:
+            v[i] = constants_[ins.lhs];
+            break;
+        case OpCode::Variable:
+            v[i] = variables[ins.lhs];
+            varying[i] = 1;
+            break;
+        case OpCode::Add:
+            v[i] = v[lhs[i]] + v[rhs[i]];
+            break;
+        case OpCode::Sub:
+            v[i] = v[lhs[i]] - v[rhs[i]];
+            break;
+        case OpCode::Mul:
+            v[i] = v[lhs[i]] * v[rhs[i]];
+            break;
+        case OpCode::Div:
+            if (v[rhs[i]] == T(0)) {
+                throw("Division by zero");
+            }
+            v[i] = v[lhs[i]] / v[rhs[i]];
+            break;
+        case OpCode::Pow:
+            v[i] = std::pow(v[lhs[i]], v[rhs[i]]);
+            break;
+        case OpCode::Sin:
+            v[i] = std::sin(v[lhs[i]]);
+            break;
+        case OpCode::Cos:
+            v[i] = std::cos(v[lhs[i]]);
+            break;
+        case OpCode::Ln:
+            v[i] = std::log(v[lhs[i]]);
+            break;
+        case OpCode::Exp:
+            v[i] = std::exp(v[lhs[i]]);
+            break;
+        }
+        if (ins.op != OpCode::Value && ins.op != OpCode::Variable) {
+            bool binary = ins.op <= OpCode::Pow;
+            varying[i] = varying[lhs[i]] || (binary && varying[rhs[i]]);
+        }
+        writer[ins.dst] = static_cast<std::uint32_t>(i);
+    }
+
+    Gradient<T> gradient{v[writer[result_]], std::vector<T>(SymbolTable::size(), T(0))};
+    std::vector<T> adjoint(n, T(0));
+    adjoint[writer[result_]] = T(1);
+    // Adjoints only flow into instructions that depend on some variable, which also keeps
+    // ln of a negative constant base out of x ^ c.
+    auto push = [&](std::uint32_t target, T value) {
+        if (varying[target]) {
+            adjoint[target] += value;
         }
-        if(depth != 0){
+    };
+    for (std::size_t i = n; i-- > 0;) {
+        T a = adjoint[i];
+        if (!varying[i] || a == T(0)) {
             continue;
         }
-        if(variable[i] == '+'){
-            std::string l = variable.substr(0, i);
-            if(l.size() == 0){
-                l = "0";
+        const Instruction& ins = code_[i];
+        T x = v[lhs[i]];
+        T y = v[rhs[i]];
+        switch (ins.op) {
+        case OpCode::Value:
+            break;
+        case OpCode::Variable:
+            gradient.partials[ins.lhs] += a;
+            break;
+        case OpCode::Add:
+            push(lhs[i], a);
+            push(rhs[i], a);
+            break;
+        case OpCode::Sub:
+            push(lhs[i], a);
+            push(rhs[i], T(-a));
+            break;
+        case OpCode::Mul:
+            push(lhs[i], T(a * y));
+            push(rhs[i], T(a * x));
+            break;
+        case OpCode::Div:
+            push(lhs[i], T(a / y));
+            push(rhs[i], T(-a * v[i] / y));
+            break;
+        case OpCode::Pow:
+            push(lhs[i], T(a * y * std::pow(x, y - T(1))));
+            if (varying[rhs[i]]) {
+                push(rhs[i], T(a * v[i] * std::log(x)));
             }
-            std::string r = variable.substr(i + 1);
-            impl_ = std::make_shared<OperationAdd<T>>(OperationAdd<T>(Expression<T>(l), Expression<T>(r)));
-            return;
+            break;
+        case OpCode::Sin:
+            push(lhs[i], T(a * std::cos(x)));
+            break;
+        case OpCode::Cos:
+            push(lhs[i], T(-a * std::sin(x)));
+            break;
+        case OpCode::Ln:
+            push(lhs[i], T(a / x));
+            break;
+        case OpCode::Exp:
+            push(lhs[i], T(a * v[i]));
+            break;
         }
-        if(variable[i] == '-'){
-            std::string l = variable.substr(0, i);
-            if(l.size() == 0){
-                l = "0";
+    }
+    return gradient;
+}
+
+template<typename T>
+const std::vector<Instruction>& CompiledExpression<T>::code() const {
+    return code_;
+}
+
+template<typename T>
+const std::vector<T>& CompiledExpression<T>::constants() const {
+    return constants_;
+}
+
+template<typename T>
+const std::vector<std::uint32_t>& CompiledExpression<T>::slots() const {
+    return slots_;
+}
+
+template<typename T>
+std::vector<std::string> CompiledExpression<T>::variables() const {
+    std::vector<std::string> names;
+    names.reserve(slots_.size());
+    for (std::uint32_t slot : slots_) {
+        names.push_back(SymbolTable::name(slot));
+    }
+    return names;
+}
+
+template<typename T>
+std::uint32_t CompiledExpression<T>::registers() const {
+    return registers_;
+}
+
+template<typename T>
+std::uint32_t CompiledExpression<T>::result() const {
+    return result_;
+}
+
+template<typename T>
+std::uint32_t ProgramBuilder<T>::allocate() {
+    std::uint32_t reg;
+    if (!free_.empty()) {
+        reg = free_.back();
+        free_.pop_back();
+    } else {
+        reg = program_.registers_++;
+        readers_.push_back(0);
+    }
+    readers_[reg] = 1;
+    return reg;
+}
+
+template<typename T>
+void ProgramBuilder<T>::release(std::uint32_t reg) {
+    if (--readers_[reg] == 0) {
+        free_.push_back(reg);
+    }
+}
+
+template<typename T>
+void ProgramBuilder<T>::count_uses(const Expression<T>& root) {
+    std::vector<const ExpressionImpl<T>*> stack = {root.node()};
+    uses_[root.node()] = 1;
+    while (!stack.empty()) {
+        const ExpressionImpl<T>* node = stack.back();
+        stack.pop_back();
+        for (std::size_t i = 0; const Expression<T>* child = node->operand(i); ++i) {
+            auto [iter, inserted] = uses_.try_emplace(child->node(), 0);
+            if (++iter->second == 1) {
+                stack.push_back(child->node());
             }
-            std::string r = variable.substr(i + 1);
-            impl_ = std::make_shared<OperationSub<T>>(OperationSub<T>(Expression<T>(l), Expression<T>(r)));
-            return;
         }
     }
-    if(depth != 0){
-        throw("parenthesis missmatch");
+}
+
+template<typename T>
+bool ProgramBuilder<T>::lookup(const ExpressionImpl<T>* node, std::uint32_t& reg) const {
+    auto iter = emitted_.find(node);
+    if (iter == emitted_.end()) {
+        return false;
     }
-    for(int i = 0; i < variable.size(); ++i){
-        if(variable[i] == '('){
-            depth++;
-            continue;
+    reg = iter->second;
+    return true;
+}
+
+template<typename T>
+void ProgramBuilder<T>::remember(const ExpressionImpl<T>* node, std::uint32_t reg) {
+    auto iter = uses_.find(node);
+    if (iter == uses_.end()) {
+        return;
+    }
+    readers_[reg] = iter->second;
+    emitted_[node] = reg;
+}
+
+template<typename T>
+std::uint32_t ProgramBuilder<T>::emit_value(T value) {
+    std::uint32_t dst = allocate();
+    program_.code_.push_back({OpCode::Value, dst, static_cast<std::uint32_t>(program_.constants_.size()), 0});
+    program_.constants_.push_back(value);
+    return dst;
+}
+
+template<typename T>
+std::uint32_t ProgramBuilder<T>::emit_variable(std::uint32_t slot) {
+    std::vector<std::uint32_t>& slots = program_.slots_;
+    if (std::find(slots.begin(), slots.end(), slot) == slots.end()) {
+        slots.push_back(slot);
+    }
+    std::uint32_t dst = allocate();
+    program_.code_.push_back({OpCode::Variable, dst, slot, 0});
+    return dst;
+}
+
+template<typename T>
+std::uint32_t ProgramBuilder<T>::emit(OpCode op, std::uint32_t lhs, std::uint32_t rhs) {
+    // Operands read for the last time die here, so the result may reuse their registers.
+    release(lhs);
+    if (op == OpCode::Add || op == OpCode::Sub || op == OpCode::Mul ||
+        op == OpCode::Div || op == OpCode::Pow) {
+        release(rhs);
+    }
+    std::uint32_t dst = allocate();
+    program_.code_.push_back({op, dst, lhs, rhs});
+    return dst;
+}
+
+template<typename T>
+CompiledExpression<T> ProgramBuilder<T>::finish(std::uint32_t result) {
+    program_.result_ = result;
+    CompiledExpression<T> program = std::move(program_);
+    program_ = CompiledExpression<T>();
+    free_.clear();
+    readers_.clear();
+    uses_.clear();
+    emitted_.clear();
+    return program;
+}
+
+// Single-pass operator-precedence parser over the source text for the grammar
+//   sum     := product (('+' | '-') product)*
+//   product := unary (('*' | '/') unary)*
+//   unary   := ('-' | '+') unary | power
+//   power   := primary ('^' unary)?
+//   primary := number | number 'i' | name | func '(' sum ')' | '(' sum ')'
+// '+', '-', '*' and '/' associate to the left, '^' to the right; unary minus becomes 0 - x.
+// Pending operators, parentheses and function calls wait on an explicit stack, so neither
+// long chains nor deep nesting recurse.
+template<typename T>
+class ExpressionParser {
+public:
+    ExpressionParser(std::string_view text) : text_(text) {}
+
+    Expression<T> parse() {
+        while (true) {
+            parse_operand();
+            // An operand is complete: close any groups it ends, then read the next operator.
+            while (true) {
+                skip_spaces();
+                if (pos_ == text_.size() || text_[pos_] != ')') {
+                    break;
+                }
+                close_group();
+            }
+            if (pos_ < text_.size() && is_binary(text_[pos_])) {
+                char op = text_[pos_++];
+                reduce(precedence(op), op != '^');
+                pending_.push_back({op, 0, {}});
+                continue;
+            }
+            if (open_groups_ > 0) {
+                throw("parenthesis missmatch");
+            }
+            if (pos_ < text_.size()) {
+                fail("unexpected character");
+            }
+            reduce(0, true);
+            return operands_.back();
         }
-        if(variable[i] == ')'){
-            depth--;
-            continue;
+    }
+private:
+    // An operator waiting for its right operand: a binary operator, 'n' for unary minus, '('
+    // for a parenthesis or 'f' for the call of the function named by name, found at start.
+    struct Pending {
+        char op;
+        std::size_t start;
+        std::string_view name;
+    };
+
+    // Reads prefix operators, opening parentheses and calls up to and including one number or
+    // variable.
+    void parse_operand() {
+        while (true) {
+            skip_spaces();
+            if (pos_ == text_.size()) {
+                fail("unexpected end of expression");
+            }
+            char c = text_[pos_];
+            if (c == '-' || c == '+' || c == '(') {
+                ++pos_;
+                if (c != '+') {
+                    pending_.push_back({c == '-' ? 'n' : '(', 0, {}});
+                    open_groups_ += c == '(';
+                }
+                continue;
+            }
+            if (is_digit(c) || c == '.') {
+                operands_.push_back(parse_number());
+                return;
+            }
+            if (!is_name_start(c)) {
+                fail("unexpected character");
+            }
+            std::size_t start = pos_;
+            while (pos_ < text_.size() && is_name_char(text_[pos_])) {
+                ++pos_;
+            }
+            std::string_view name = text_.substr(start, pos_ - start);
+            if (!accept('(')) {
+                operands_.push_back(Expression<T>(intern<T>(make_node<Variable<T>>(std::string(name)))));
+                return;
+            }
+            pending_.push_back({'f', start, name});
+            ++open_groups_;
         }
-        if(depth != 0){
-            continue;
+    }
+
+    void close_group() {
+        if (open_groups_ == 0) {
+            throw("parenthesis missmatch");
         }
-        if(variable[i] == '*'){
-            std::string l = variable.substr(0, i);
-            std::string r = variable.substr(i + 1);
-            impl_ = std::make_shared<OperationMul<T>>(OperationMul<T>(Expression<T>(l), Expression<T>(r)));
+        ++pos_;
+        reduce(0, true);
+        Pending group = pending_.back();
+        pending_.pop_back();
+        --open_groups_;
+        if (group.op == '(') {
             return;
         }
-        if(variable[i] == '/'){
-            std::string l = variable.substr(0, i);
-            std::string r = variable.substr(i + 1);
-            impl_ = std::make_shared<OperationDiv<T>>(OperationDiv<T>(Expression<T>(l), Expression<T>(r)));
-            return;
+        Expression<T>& argument = operands_.back();
+        if (group.name == "sin") {
+            argument = sin(argument);
+        } else if (group.name == "cos") {
+            argument = cos(argument);
+        } else if (group.name == "exp") {
+            argument = exp(argument);
+        } else if (group.name == "ln") {
+            argument = ln(argument);
+        } else {
+            pos_ = group.start;
+            fail("unknown function \"" + std::string(group.name) + "\"");
         }
     }
 
-    for(int i = 0; i < variable.size(); ++i){
-        if(variable[i] == '('){
-            depth++;
-            continue;
+    // Applies the pending operators, down to the innermost open group, that bind at least as
+    // tightly as an operator of the given precedence (strictly tighter unless left-associative).
+    void reduce(int bound, bool left_associative) {
+        while (!pending_.empty() && pending_.back().op != '(' && pending_.back().op != 'f') {
+            int top = precedence(pending_.back().op);
+            if (top < bound || (top == bound && !left_associative)) {
+                return;
+            }
+            char op = pending_.back().op;
+            pending_.pop_back();
+            Expression<T> rhs = std::move(operands_.back());
+            operands_.pop_back();
+            if (op == 'n') {
+                operands_.push_back(Expression<T>(T(0)) - rhs);
+                continue;
+            }
+            Expression<T>& lhs = operands_.back();
+            switch (op) {
+            case '+':
+                lhs = lhs + rhs;
+                break;
+            case '-':
+                lhs = lhs - rhs;
+                break;
+            case '*':
+                lhs = lhs * rhs;
+                break;
+            case '/':
+                lhs = lhs / rhs;
+                break;
+            default:
+                lhs = lhs ^ rhs;
+                break;
+            }
         }
-        if(variable[i] == ')'){
-            depth--;
-            continue;
+    }
+
+    // Unary minus binds tighter than '*' and '/' but looser than '^', so -x ^ 2 is -(x ^ 2).
+    static int precedence(char op) {
+        switch (op) {
+        case '+':
+        case '-':
+            return 1;
+        case '*':
+        case '/':
+            return 2;
+        case 'n':
+            return 3;
+        default:
+            return 4;
+        }
+    }
+
+    static bool is_binary(char c) {
+        return c == '+' || c == '-' || c == '*' || c == '/' || c == '^';
+    }
+
+    Expression<T> parse_number() {
+        std::size_t start = pos_;
+        while (pos_ < text_.size() && (is_digit(text_[pos_]) || text_[pos_] == '.')) {
+            ++pos_;
+        }
+        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            std::size_t exponent = pos_ + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (exponent < text_.size() && is_digit(text_[exponent])) {
+                pos_ = exponent;
+                while (pos_ < text_.size() && is_digit(text_[pos_])) {
+                    ++pos_;
+                }
+            }
+        }
+        std::string_view literal = text_.substr(start, pos_ - start);
+        bool imaginary = pos_ < text_.size() && text_[pos_] == 'i';
+        if (imaginary) {
+            ++pos_;
+        }
+        if (pos_ < text_.size() && is_name_char(text_[pos_])) {
+            fail("unexpected character");
+        }
+        if constexpr (is_std_complex<T>::value) {
+            typename T::value_type value = to_number<typename T::value_type>(literal, start);
+            return Expression<T>(imaginary ? T(0, value) : T(value, 0));
+        } else {
+            if (imaginary) {
+                pos_ = start;
+                fail("imaginary literal in a real expression");
+            }
+            if constexpr (std::is_floating_point_v<T>) {
+                return Expression<T>(to_number<T>(literal, start));
+            } else {
+                return Expression<T>(T(to_number<double>(literal, start)));
+            }
+        }
+    }
+
+    template<typename N>
+    N to_number(std::string_view literal, std::size_t start) {
+        N value{};
+        auto [end, error] = std::from_chars(literal.data(), literal.data() + literal.size(), value);
+        if (error != std::errc() || end != literal.data() + literal.size()) {
+            pos_ = start;
+            fail("malformed number");
+        }
+        return value;
+    }
+
+    void skip_spaces() {
+        while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            ++pos_;
         }
-        if(depth != 0){
+    }
+
+    bool accept(char c) {
+        skip_spaces();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw(message + " at position " + std::to_string(pos_) + " in \"" + std::string(text_) + "\"");
+    }
+
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool is_name_start(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    static bool is_name_char(char c) {
+        return is_name_start(c) || is_digit(c);
+    }
+
+    std::string_view text_;
+    std::size_t pos_ = 0;
+    std::vector<Expression<T>> operands_;
+    std::vector<Pending> pending_;
+    std::size_t open_groups_ = 0;
+};
+
+template<typename T>
+std::size_t Expression<T>::memory_bytes() const {
+    // Every node is at most as large as a binary operation, plus its shared_ptr control block.
+    constexpr std::size_t node_bytes = sizeof(OperationAdd<T>) + 2 * sizeof(void*);
+    std::unordered_set<const ExpressionImpl<T>*> seen;
+    std::vector<const ExpressionImpl<T>*> stack = {node()};
+    while (!stack.empty()) {
+        const ExpressionImpl<T>* current = stack.back();
+        stack.pop_back();
+        if (!seen.insert(current).second) {
             continue;
         }
-        if(variable[i] == '^'){
-            std::string l = variable.substr(0, i);
-            std::string r = variable.substr(i + 1);
-            impl_ = std::make_shared<OperationPow<T>>(OperationPow<T>(Expression<T>(l), Expression<T>(r)));
-            return;
+        for (std::size_t i = 0; const Expression<T>* child = current->operand(i); ++i) {
+            stack.push_back(child->node());
         }
     }
-    
-    if(variable[0] == '('){
-        if(variable[variable.size() - 1] != ')'){
-            throw("parenthesis missmatch");
-        } else {
-            std::string r = variable.substr(1, variable.size() - 2);
-            Expression<T> qwe = Expression<T>(r);
-            qwe = qwe - qwe;
-            impl_ = std::make_shared<OperationAdd<T>>(OperationAdd<T>(qwe, Expression<T>(r)));
-            return;
+    return seen.size() * node_bytes;
+}
+
+template<typename T>
+Expression<T>::Expression(std::string variable) {
+    ParseCache<T>& cache = ParseCache<T>::shared();
+    impl_ = cache.budget() > 0 ? cache.parse(variable).impl_ : ExpressionParser<T>(variable).parse().impl_;
+}
+
+template<typename T>
+ParseCache<T>::ParseCache(std::size_t byte_budget) : budget_(byte_budget) {}
+
+template<typename T>
+ParseCache<T>& ParseCache<T>::shared() {
+    static ParseCache cache(0);
+    return cache;
+}
+
+template<typename T>
+Expression<T> ParseCache<T>::parse(const std::string& text) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = index_.find(text);
+        if (iter != index_.end()) {
+            ++stats_.hits;
+            entries_.splice(entries_.begin(), entries_, iter->second);
+            return iter->second->expr;
         }
+        ++stats_.misses;
+    }
+    Expression<T> expr = ExpressionParser<T>(text).parse();
+    std::size_t bytes = cost(text, expr);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (bytes > budget_ || index_.contains(text)) {
+        return expr;
     }
+    entries_.push_front({text, expr, bytes});
+    index_.emplace(entries_.front().text, entries_.begin());
+    stats_.bytes += bytes;
+    evict();
+    return expr;
+}
 
-    if(variable.substr(0, 4) == "sin("){
-        std::string r = variable.substr(4, variable.size() - 5);
-        impl_ = std::make_shared<OperationSin<T>>(OperationSin<T>(r));
-        return;
+template<typename T>
+std::size_t ParseCache<T>::cost(const std::string& text, const Expression<T>& expr) {
+    // Nodes shared with other entries are charged to each of them, so the estimate errs high.
+    return sizeof(Entry) + 4 * sizeof(void*) + text.size() + expr.memory_bytes();
+}
+
+template<typename T>
+void ParseCache<T>::evict() {
+    while (stats_.bytes > budget_ && !entries_.empty()) {
+        Entry& cold = entries_.back();
+        stats_.bytes -= cold.bytes;
+        ++stats_.evictions;
+        index_.erase(cold.text);
+        entries_.pop_back();
     }
+}
 
-    if(variable.substr(0, 4) == "cos("){
-        std::string r = variable.substr(4, variable.size() - 5);
-        impl_ = std::make_shared<OperationCos<T>>(OperationCos<T>(r));
-        return;
+template<typename T>
+void ParseCache<T>::set_budget(std::size_t byte_budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = byte_budget;
+    evict();
+}
+
+template<typename T>
+std::size_t ParseCache<T>::budget() const {
+    return budget_;
+}
+
+template<typename T>
+void ParseCache<T>::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    index_.clear();
+    entries_.clear();
+    stats_.bytes = 0;
+}
+
+template<typename T>
+ParseCacheStats ParseCache<T>::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ParseCacheStats stats = stats_;
+    stats.entries = entries_.size();
+    return stats;
+}
+
+namespace {
+
+template<typename T>
+const Value<T>* as_value(const Expression<T>& expr) {
+    const ExpressionImpl<T>* node = expr.node();
+    return node->op() == OpCode::Value ? static_cast<const Value<T>*>(node) : nullptr;
+}
+
+template<typename T>
+bool is_constant(const Expression<T>& expr, int constant) {
+    const Value<T>* value = as_value(expr);
+    return value && value->value() == T(constant);
+}
+
+// Canonical operand order for + and *: constants, then variables by name, then the rest.
+template<typename T>
+bool precedes(const Expression<T>& a, const Expression<T>& b) {
+    auto rank = [](OpCode op) { return op == OpCode::Value ? 0 : op == OpCode::Variable ? 1 : 2; };
+    const ExpressionImpl<T>* x = a.node();
+    const ExpressionImpl<T>* y = b.node();
+    if (rank(x->op()) != rank(y->op())) {
+        return rank(x->op()) < rank(y->op());
+    }
+    if (x->op() == OpCode::Variable) {
+        return static_cast<const Variable<T>*>(x)->name() < static_cast<const Variable<T>*>(y)->name();
+    }
+    if (x->op() != y->op()) {
+        return x->op() < y->op();
     }
+    return x->hash() < y->hash();
+}
 
-    if(variable.substr(0, 4) == "exp("){
-        std::string r = variable.substr(4, variable.size() - 5);
-        impl_ = std::make_shared<OperationExp<T>>(OperationExp<T>(r));
-        return;
+template<typename T>
+Expression<T> fold(OpCode op, T a, T b) {
+    switch (op) {
+    case OpCode::Add:
+        return Expression<T>(T(a + b));
+    case OpCode::Sub:
+        return Expression<T>(T(a - b));
+    case OpCode::Mul:
+        return Expression<T>(T(a * b));
+    case OpCode::Div:
+        return Expression<T>(T(a / b));
+    case OpCode::Pow:
+        return Expression<T>(T(std::pow(a, b)));
+    case OpCode::Sin:
+        return Expression<T>(T(std::sin(a)));
+    case OpCode::Cos:
+        return Expression<T>(T(std::cos(a)));
+    case OpCode::Ln:
+        return Expression<T>(T(std::log(a)));
+    case OpCode::Exp:
+        return Expression<T>(T(std::exp(a)));
+    default:
+        return Expression<T>(a);
     }
+}
 
-    if(variable.substr(0, 3) == "ln("){
-        std::string r = variable.substr(3, variable.size() - 4);
-        impl_ = std::make_shared<OperationLn<T>>(OperationLn<T>(r));
-        return;
+// Rebuilds one node of kind op over already simplified operands.
+template<typename T>
+Expression<T> simplify_node(const Expression<T>& original, OpCode op, const Expression<T>& a, const Expression<T>& b) {
+    const Value<T>* ca = as_value(a);
+    const Value<T>* cb = op <= OpCode::Pow ? as_value(b) : nullptr;
+    bool binary = op >= OpCode::Add && op <= OpCode::Pow;
+    if (ca && (!binary || cb) && !(op == OpCode::Div && cb->value() == T(0))) {
+        return fold(op, ca->value(), binary ? cb->value() : T(0));
+    }
+    switch (op) {
+    case OpCode::Add:
+        if (is_constant(a, 0)) {
+            return b;
+        }
+        if (is_constant(b, 0)) {
+            return a;
+        }
+        return precedes(b, a) ? b + a : a + b;
+    case OpCode::Sub:
+        if (is_constant(b, 0)) {
+            return a;
+        }
+        if (a == b) {
+            return Expression<T>(T(0));
+        }
+        if (b.node()->op() == OpCode::Sub && is_constant(*b.node()->operand(0), 0)) {
+            return simplify_node(original, OpCode::Add, a, *b.node()->operand(1));
+        }
+        return a - b;
+    case OpCode::Mul:
+        if (is_constant(a, 0) || is_constant(b, 0)) {
+            return Expression<T>(T(0));
+        }
+        if (is_constant(a, 1)) {
+            return b;
+        }
+        if (is_constant(b, 1)) {
+            return a;
+        }
+        return precedes(b, a) ? b * a : a * b;
+    case OpCode::Div:
+        if (is_constant(b, 1)) {
+            return a;
+        }
+        return a / b;
+    case OpCode::Pow:
+        if (is_constant(b, 1)) {
+            return a;
+        }
+        if (is_constant(b, 0) || is_constant(a, 1)) {
+            return Expression<T>(T(1));
+        }
+        return a ^ b;
+    case OpCode::Sin:
+        return sin(a);
+    case OpCode::Cos:
+        return cos(a);
+    case OpCode::Exp:
+        return exp(a);
+    case OpCode::Ln:
+        // The complex logarithm takes its principal branch, so ln(exp(x)) is x only for some x.
+        if (!is_std_complex<T>::value && a.node()->op() == OpCode::Exp) {
+            return *a.node()->operand(0);
+        }
+        return ln(a);
+    default:
+        return original;
     }
+}
 
-    if(variable[0] >= '0' && variable[0] <= '9'){
-        if constexpr (is_std_complex<T>::value){
-            if(variable[variable.size() - 1] == 'i'){
-                variable.pop_back();
-                T r(0, (double)std::stod(variable));
-                impl_ = std::make_shared<Value<T>>(r);
-                return;
+}
+
+template<typename T>
+Expression<T> Expression<T>::simplify() const {
+    // Iterative post-order walk so deep trees do not exhaust the stack; shared nodes are
+    // simplified once.
+    std::unordered_map<const ExpressionImpl<T>*, Expression<T>> done;
+    std::vector<std::pair<const Expression<T>*, bool>> stack = {{this, false}};
+    while (!stack.empty()) {
+        auto [expr, expanded] = stack.back();
+        const ExpressionImpl<T>* node = expr->node();
+        if (done.count(node)) {
+            stack.pop_back();
+            continue;
+        }
+        if (!expanded) {
+            stack.back().second = true;
+            for (std::size_t i = 0; const Expression<T>* child = node->operand(i); ++i) {
+                if (!done.count(child->node())) {
+                    stack.push_back({child, false});
+                }
             }
-            T r((double)std::stod(variable), 0);
-            impl_ = std::make_shared<Value<T>>(r);
-            return;
+            continue;
         }
-        T r = std::stod(variable);
-        impl_ = std::make_shared<Value<T>>(r);
-        return;
+        stack.pop_back();
+        const Expression<T>* lhs = node->operand(0);
+        const Expression<T>* rhs = node->operand(1);
+        if (!lhs) {
+            done.emplace(node, *expr);
+            continue;
+        }
+        const Expression<T>& a = done.at(lhs->node());
+        const Expression<T>& b = rhs ? done.at(rhs->node()) : a;
+        done.emplace(node, simplify_node(*expr, node->op(), a, b));
     }
-    impl_ = std::make_shared<Variable<T>>(variable);
+    return done.at(impl_.get());
 }
+
+template struct Interval<double>;
+template struct Interval<long double>;
+template struct Interval<int>;
+template class EvalContext<double>;
+template class EvalContext<long double>;
+template class EvalContext<int>;
+template class EvalContext<std::complex<double>>;
+template class EvalContext<std::complex<float>>;
+template class Expression<double>;
 template class Expression<long double>;
 template class Expression<int>;
+template class Expression<std::complex<double>>;
+template class Expression<std::complex<float>>;
+template class CompiledExpression<double>;
+template class CompiledExpression<long double>;
+template class CompiledExpression<int>;
+template class CompiledExpression<std::complex<double>>;
+template class CompiledExpression<std::complex<float>>;
+template class ProgramBuilder<double>;
+template class ProgramBuilder<long double>;
+template class ProgramBuilder<int>;
+template class ProgramBuilder<std::complex<double>>;
+template class ProgramBuilder<std::complex<float>>;
+template class ParseCache<double>;
+template class ParseCache<long double>;
+template class ParseCache<int>;
+template class ParseCache<std::complex<double>>;
+template class ParseCache<std::complex<float>>;
+template class Value<double>;
+template class Value<long double>;
+template class Value<int>;
+template class Value<std::complex<double>>;
+template class Value<std::complex<float>>;
+template class Variable<double>;
+template class Variable<long double>;
+template class Variable<int>;
+template class Variable<std::complex<double>>;
+template class Variable<std::complex<float>>;
+template std::ostream& operator<< <double>(std::ostream&, const Expression<double>&);
+template std::ostream& operator<< <long double>(std::ostream&, const Expression<long double>&);
+template std::ostream& operator<< <int>(std::ostream&, const Expression<int>&);
+template std::ostream& operator<< <std::complex<double> >(std::ostream&, const Expression<std::complex<double>>&);
+template std::ostream& operator<< <std::complex<float> >(std::ostream&, const Expression<std::complex<float>>&);
+template Expression<double> sin<double>(Expression<double>);
+template Expression<double> cos<double>(Expression<double>);
+template Expression<double> exp<double>(Expression<double>);
+template Expression<double> ln<double>(Expression<double>);
 template Expression<long double> sin<long double>(Expression<long double>);
 template Expression<long double> cos<long double>(Expression<long double>);
 template Expression<long double> exp<long double>(Expression<long double>);
@@ -510,4 +2668,12 @@ template Expression<long double> ln<long double>(Expression<long double>);
 template Expression<int> sin<int>(Expression<int>);
 template Expression<int> cos<int>(Expression<int>);
 template Expression<int> exp<int>(Expression<int>);
-template Expression<int> ln<int>(Expression<int>);
\ No newline at end of file
+template Expression<int> ln<int>(Expression<int>);
+template Expression<std::complex<double>> sin<std::complex<double>>(Expression<std::complex<double>>);
+template Expression<std::complex<double>> cos<std::complex<double>>(Expression<std::complex<double>>);
+template Expression<std::complex<double>> exp<std::complex<double>>(Expression<std::complex<double>>);
+template Expression<std::complex<double>> ln<std::complex<double>>(Expression<std::complex<double>>);
+template Expression<std::complex<float>> sin<std::complex<float>>(Expression<std::complex<float>>);
+template Expression<std::complex<float>> cos<std::complex<float>>(Expression<std::complex<float>>);
+template Expression<std::complex<float>> exp<std::complex<float>>(Expression<std::complex<float>>);
+template Expression<std::complex<float>> ln<std::complex<float>>(Expression<std::complex<float>>);
\ No newline at end of file
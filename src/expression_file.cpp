@@ -0,0 +1,345 @@
+#include "expression_file.hpp"
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char magic[8] = {'E', 'X', 'P', 'R', 'F', 'L', 'A', 'T'};
+constexpr std::uint32_t byte_order = 0x01020304;
+constexpr std::uint32_t version = 1;
+
+static_assert(sizeof(FlatNode) == 12 && offsetof(FlatNode, lhs) == 4 && offsetof(FlatNode, rhs) == 8,
+              "FlatNode must match the 12-byte node records of the file format");
+
+template<typename T>
+constexpr std::uint32_t value_type();
+
+template<>
+constexpr std::uint32_t value_type<double>() { return 1; }
+
+template<>
+constexpr std::uint32_t value_type<long double>() { return 2; }
+
+template<>
+constexpr std::uint32_t value_type<int>() { return 3; }
+
+template<>
+constexpr std::uint32_t value_type<std::complex<double>>() { return 4; }
+
+template<>
+constexpr std::uint32_t value_type<std::complex<float>>() { return 5; }
+
+std::uint64_t align(std::uint64_t offset, std::uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+template<typename V>
+void put(std::string& out, std::uint64_t offset, const V& value) {
+    std::memcpy(out.data() + offset, &value, sizeof(V));
+}
+
+// Sections of a file image after every offset and size has been checked against its length.
+template<typename T>
+struct Sections {
+    const FlatNode* nodes;
+    const T* constants;
+    std::vector<std::string_view> names;
+    std::string_view source;
+    std::uint32_t node_count;
+    std::uint32_t constant_count;
+};
+
+template<typename T>
+Sections<T> read_sections(std::string_view bytes) {
+    ExpressionFileHeader header;
+    if (bytes.size() < sizeof(header)) {
+        throw("Truncated expression file");
+    }
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if (std::memcmp(header.magic, magic, sizeof(magic)) != 0) {
+        throw("Not an expression file");
+    }
+    if (header.byte_order != byte_order) {
+        throw("Expression file has a foreign byte order");
+    }
+    if (header.version > version) {
+        throw("Expression file version " + std::to_string(header.version) + " is not supported");
+    }
+    if (header.value_type != value_type<T>() || header.value_size != sizeof(T)) {
+        throw("Expression file holds another value type");
+    }
+    auto check = [&](std::uint64_t offset, std::uint64_t size, std::uint64_t alignment) {
+        if (offset % alignment != 0 || offset > bytes.size() || size > bytes.size() - offset) {
+            throw("Corrupt expression file");
+        }
+    };
+    check(header.nodes_offset, std::uint64_t(header.node_count) * sizeof(FlatNode), alignof(FlatNode));
+    check(header.constants_offset, std::uint64_t(header.constant_count) * sizeof(T), alignof(T));
+    check(header.names_offset, std::uint64_t(header.variable_count) * 8, 4);
+    check(header.source_offset, header.source_size, 1);
+    if (reinterpret_cast<std::uintptr_t>(bytes.data()) % alignof(T) != 0) {
+        throw("Expression file image is not aligned");
+    }
+    Sections<T> sections;
+    sections.nodes = reinterpret_cast<const FlatNode*>(bytes.data() + header.nodes_offset);
+    sections.constants = reinterpret_cast<const T*>(bytes.data() + header.constants_offset);
+    sections.node_count = header.node_count;
+    sections.constant_count = header.constant_count;
+    sections.source = bytes.substr(header.source_offset, header.source_size);
+    for (std::uint32_t i = 0; i < header.variable_count; ++i) {
+        std::uint32_t entry[2];
+        std::memcpy(entry, bytes.data() + header.names_offset + 8 * i, sizeof(entry));
+        check(header.names_offset + entry[0], entry[1], 1);
+        sections.names.push_back(bytes.substr(header.names_offset + entry[0], entry[1]));
+    }
+    FlatExpression<T>::validate(std::span<const FlatNode>(sections.nodes, sections.node_count),
+                                sections.constant_count, sections.names.size());
+    return sections;
+}
+
+std::vector<std::uint32_t> intern_names(const std::vector<std::string_view>& names) {
+    std::vector<std::uint32_t> slots;
+    for (std::string_view name : names) {
+        slots.push_back(SymbolTable::intern(std::string(name)));
+    }
+    return slots;
+}
+
+}
+
+template<typename T>
+std::string save_expression(const FlatExpression<T>& expr, std::string_view source) {
+    // Slots are process-local, so variables are renumbered in order of appearance.
+    std::vector<FlatNode> nodes = expr.nodes();
+    std::map<std::uint32_t, std::uint32_t> local;
+    std::vector<std::string> names;
+    for (FlatNode& n : nodes) {
+        if (n.op != OpCode::Variable) {
+            continue;
+        }
+        auto [iter, inserted] = local.emplace(n.lhs, static_cast<std::uint32_t>(names.size()));
+        if (inserted) {
+            names.push_back(SymbolTable::name(n.lhs));
+        }
+        n.lhs = iter->second;
+    }
+
+    ExpressionFileHeader header = {};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.byte_order = byte_order;
+    header.version = version;
+    header.value_type = value_type<T>();
+    header.value_size = sizeof(T);
+    header.node_count = static_cast<std::uint32_t>(nodes.size());
+    header.constant_count = static_cast<std::uint32_t>(expr.constants().size());
+    header.variable_count = static_cast<std::uint32_t>(names.size());
+    header.source_size = static_cast<std::uint32_t>(source.size());
+    header.nodes_offset = align(sizeof(header), 16);
+    header.constants_offset = align(header.nodes_offset + nodes.size() * sizeof(FlatNode), 16);
+    header.names_offset = align(header.constants_offset + expr.constants().size() * sizeof(T), 16);
+    std::uint64_t characters = header.names_offset + 8 * names.size();
+    std::uint64_t names_end = characters;
+    for (const std::string& name : names) {
+        names_end += name.size();
+    }
+    header.source_offset = names_end;
+
+    std::string out(header.source_offset + source.size(), '\0');
+    put(out, 0, header);
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        // Field by field, so the padding after op is always zero.
+        std::uint64_t at = header.nodes_offset + i * sizeof(FlatNode);
+        put(out, at, nodes[i].op);
+        put(out, at + offsetof(FlatNode, lhs), nodes[i].lhs);
+        put(out, at + offsetof(FlatNode, rhs), nodes[i].rhs);
+    }
+    for (std::size_t i = 0; i < expr.constants().size(); ++i) {
+        put(out, header.constants_offset + i * sizeof(T), expr.constants()[i]);
+    }
+    std::uint64_t at = characters;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        std::uint32_t entry[2] = {static_cast<std::uint32_t>(at - header.names_offset), static_cast<std::uint32_t>(names[i].size())};
+        put(out, header.names_offset + 8 * i, entry);
+        std::memcpy(out.data() + at, names[i].data(), names[i].size());
+        at += names[i].size();
+    }
+    if (!source.empty()) {
+        std::memcpy(out.data() + header.source_offset, source.data(), source.size());
+    }
+    return out;
+}
+
+template<typename T>
+void save_expression_file(const std::string& path, const FlatExpression<T>& expr, std::string_view source) {
+    std::string bytes = save_expression(expr, source);
+    // Written next to the target and renamed, so a concurrent reader never maps a partial file.
+    std::string temporary = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        if (!file) {
+            throw("Cannot write expression file \"" + temporary + "\"");
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw("Cannot write expression file \"" + path + "\"");
+    }
+}
+
+template<typename T>
+FlatExpression<T> load_expression(std::string_view bytes) {
+    // The image may sit at any address, so it is copied to aligned storage first.
+    std::vector<std::max_align_t> storage((bytes.size() + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+    std::memcpy(storage.data(), bytes.data(), bytes.size());
+    Sections<T> sections = read_sections<T>(std::string_view(reinterpret_cast<const char*>(storage.data()), bytes.size()));
+    std::vector<std::uint32_t> slots = intern_names(sections.names);
+    std::vector<FlatNode> nodes(sections.nodes, sections.nodes + sections.node_count);
+    for (FlatNode& n : nodes) {
+        if (n.op == OpCode::Variable) {
+            n.lhs = slots[n.lhs];
+        }
+    }
+    return FlatExpression<T>(std::move(nodes), std::vector<T>(sections.constants, sections.constants + sections.constant_count));
+}
+
+template<typename T>
+MappedExpression<T>::MappedExpression(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw("Cannot open expression file \"" + path + "\"");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        throw("Cannot read expression file \"" + path + "\"");
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    void* pages = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pages == MAP_FAILED) {
+        throw("Cannot map expression file \"" + path + "\"");
+    }
+    pages_ = pages;
+    try {
+        Sections<T> sections = read_sections<T>(std::string_view(static_cast<const char*>(pages), size_));
+        nodes_ = std::span<const FlatNode>(sections.nodes, sections.node_count);
+        constants_ = std::span<const T>(sections.constants, sections.constant_count);
+        source_ = sections.source;
+        slots_ = intern_names(sections.names);
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+template<typename T>
+MappedExpression<T>::MappedExpression(MappedExpression&& moved)
+    : pages_(std::exchange(moved.pages_, nullptr)),
+      size_(std::exchange(moved.size_, 0)),
+      nodes_(std::exchange(moved.nodes_, {})),
+      constants_(std::exchange(moved.constants_, {})),
+      source_(std::exchange(moved.source_, {})),
+      slots_(std::move(moved.slots_)) {}
+
+template<typename T>
+MappedExpression<T>& MappedExpression<T>::operator=(MappedExpression&& that) {
+    if (this == &that) {
+        return *this;
+    }
+    release();
+    pages_ = std::exchange(that.pages_, nullptr);
+    size_ = std::exchange(that.size_, 0);
+    nodes_ = std::exchange(that.nodes_, {});
+    constants_ = std::exchange(that.constants_, {});
+    source_ = std::exchange(that.source_, {});
+    slots_ = std::move(that.slots_);
+    return *this;
+}
+
+template<typename T>
+MappedExpression<T>::~MappedExpression() {
+    release();
+}
+
+template<typename T>
+void MappedExpression<T>::release() {
+    if (pages_) {
+        munmap(pages_, size_);
+    }
+    pages_ = nullptr;
+    size_ = 0;
+}
+
+template<typename T>
+T MappedExpression<T>::eval(const std::map<std::string, T>& context) const {
+    return eval(EvalContext<T>(context));
+}
+
+template<typename T>
+T MappedExpression<T>::eval(const EvalContext<T>& context) const {
+    std::vector<T> values(nodes_.size());
+    FlatExpression<T>::run(nodes_, constants_.data(), values.data(), context, slots_);
+    return values.back();
+}
+
+template<typename T>
+FlatExpression<T> MappedExpression<T>::flat() const {
+    std::vector<FlatNode> nodes(nodes_.begin(), nodes_.end());
+    for (FlatNode& n : nodes) {
+        if (n.op == OpCode::Variable) {
+            n.lhs = slots_[n.lhs];
+        }
+    }
+    return FlatExpression<T>(std::move(nodes), std::vector<T>(constants_.begin(), constants_.end()));
+}
+
+template<typename T>
+Expression<T> MappedExpression<T>::to_expression() const {
+    return flat().to_expression();
+}
+
+template<typename T>
+std::span<const FlatNode> MappedExpression<T>::nodes() const {
+    return nodes_;
+}
+
+template<typename T>
+std::span<const T> MappedExpression<T>::constants() const {
+    return constants_;
+}
+
+template<typename T>
+std::string_view MappedExpression<T>::source() const {
+    return source_;
+}
+
+template std::string save_expression(const FlatExpression<double>&, std::string_view);
+template std::string save_expression(const FlatExpression<long double>&, std::string_view);
+template std::string save_expression(const FlatExpression<int>&, std::string_view);
+template std::string save_expression(const FlatExpression<std::complex<double>>&, std::string_view);
+template std::string save_expression(const FlatExpression<std::complex<float>>&, std::string_view);
+template void save_expression_file(const std::string&, const FlatExpression<double>&, std::string_view);
+template void save_expression_file(const std::string&, const FlatExpression<long double>&, std::string_view);
+template void save_expression_file(const std::string&, const FlatExpression<int>&, std::string_view);
+template void save_expression_file(const std::string&, const FlatExpression<std::complex<double>>&, std::string_view);
+template void save_expression_file(const std::string&, const FlatExpression<std::complex<float>>&, std::string_view);
+template FlatExpression<double> load_expression(std::string_view);
+template FlatExpression<long double> load_expression(std::string_view);
+template FlatExpression<int> load_expression(std::string_view);
+template FlatExpression<std::complex<double>> load_expression(std::string_view);
+template FlatExpression<std::complex<float>> load_expression(std::string_view);
+template class MappedExpression<double>;
+template class MappedExpression<long double>;
+template class MappedExpression<int>;
+template class MappedExpression<std::complex<double>>;
+template class MappedExpression<std::complex<float>>;
@@ -0,0 +1,265 @@
+#include "flat_expression.hpp"
+#include <cmath>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+template<typename T>
+FlatExpression<T>::FlatExpression(const Expression<T>& expr) : FlatExpression(std::span<const Expression<T>>(&expr, 1)) {}
+
+template<typename T>
+FlatExpression<T>::FlatExpression(std::span<const Expression<T>> exprs) {
+    std::unordered_map<const ExpressionImpl<T>*, std::uint32_t> index;
+    for (const Expression<T>& expr : exprs) {
+        std::vector<std::pair<const Expression<T>*, bool>> stack = {{&expr, false}};
+        while (!stack.empty()) {
+            auto [current, expanded] = stack.back();
+            const ExpressionImpl<T>* node = current->node();
+            if (index.contains(node)) {
+                stack.pop_back();
+                continue;
+            }
+            if (!expanded) {
+                stack.back().second = true;
+                for (std::size_t i = 0; const Expression<T>* child = node->operand(i); ++i) {
+                    stack.push_back({child, false});
+                }
+                continue;
+            }
+            stack.pop_back();
+            FlatNode flat = {node->op(), 0, 0};
+            switch (node->op()) {
+            case OpCode::Value:
+                flat.lhs = static_cast<std::uint32_t>(constants_.size());
+                constants_.push_back(static_cast<const Value<T>*>(node)->value());
+                break;
+            case OpCode::Variable:
+                flat.lhs = static_cast<const Variable<T>*>(node)->slot();
+                break;
+            default:
+                flat.lhs = index.at(node->operand(0)->node());
+                if (const Expression<T>* rhs = node->operand(1)) {
+                    flat.rhs = index.at(rhs->node());
+                }
+                break;
+            }
+            index.emplace(node, static_cast<std::uint32_t>(nodes_.size()));
+            nodes_.push_back(flat);
+        }
+        roots_.push_back(index.at(expr.node()));
+    }
+}
+
+template<typename T>
+FlatExpression<T>::FlatExpression(std::vector<FlatNode> nodes, std::vector<T> constants)
+    : nodes_(std::move(nodes)), constants_(std::move(constants)) {
+    validate(nodes_, constants_.size());
+    roots_ = {static_cast<std::uint32_t>(nodes_.size() - 1)};
+}
+
+template<typename T>
+void FlatExpression<T>::validate(std::span<const FlatNode> nodes, std::size_t constant_count, std::size_t variable_count) {
+    if (nodes.empty()) {
+        throw("Empty expression");
+    }
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        const FlatNode& n = nodes[i];
+        bool valid;
+        switch (n.op) {
+        case OpCode::Value:
+            valid = n.lhs < constant_count;
+            break;
+        case OpCode::Variable:
+            valid = n.lhs < variable_count;
+            break;
+        case OpCode::Add:
+        case OpCode::Sub:
+        case OpCode::Mul:
+        case OpCode::Div:
+        case OpCode::Pow:
+            valid = n.lhs < i && n.rhs < i;
+            break;
+        case OpCode::Sin:
+        case OpCode::Cos:
+        case OpCode::Ln:
+        case OpCode::Exp:
+            valid = n.lhs < i && n.rhs == 0;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+        if (!valid) {
+            throw("Malformed node " + std::to_string(i) + " in a flat expression");
+        }
+    }
+}
+
+template<typename T>
+Expression<T> FlatExpression<T>::to_expression() const {
+    return expressions().back();
+}
+
+template<typename T>
+std::vector<Expression<T>> FlatExpression<T>::expressions() const {
+    if (nodes_.empty()) {
+        throw("Empty expression");
+    }
+    std::vector<Expression<T>> built(nodes_.size());
+    for (std::size_t i = 0; i < nodes_.size(); ++i) {
+        const FlatNode& n = nodes_[i];
+        switch (n.op) {
+        case OpCode::Value:
+            built[i] = Expression<T>(constants_[n.lhs]);
+            break;
+        case OpCode::Variable:
+            built[i] = Expression<T>(SymbolTable::name(n.lhs));
+            break;
+        case OpCode::Add:
+            built[i] = built[n.lhs] + built[n.rhs];
+            break;
+        case OpCode::Sub:
+            built[i] = built[n.lhs] - built[n.rhs];
+            break;
+        case OpCode::Mul:
+            built[i] = built[n.lhs] * built[n.rhs];
+            break;
+        case OpCode::Div:
+            built[i] = built[n.lhs] / built[n.rhs];
+            break;
+        case OpCode::Pow:
+            built[i] = built[n.lhs] ^ built[n.rhs];
+            break;
+        case OpCode::Sin:
+            built[i] = sin(built[n.lhs]);
+            break;
+        case OpCode::Cos:
+            built[i] = cos(built[n.lhs]);
+            break;
+        case OpCode::Ln:
+            built[i] = ln(built[n.lhs]);
+            break;
+        case OpCode::Exp:
+            built[i] = exp(built[n.lhs]);
+            break;
+        }
+    }
+    return built;
+}
+
+template<typename T>
+T FlatExpression<T>::eval(const std::map<std::string, T>& context) const {
+    return eval(EvalContext<T>(context));
+}
+
+template<typename T>
+T FlatExpression<T>::eval(const EvalContext<T>& context) const {
+    if (nodes_.empty()) {
+        throw("Empty expression");
+    }
+    std::vector<T> values(nodes_.size());
+    run(nodes_, constants_.data(), values.data(), context);
+    return values.back();
+}
+
+template<typename T>
+void FlatExpression<T>::run(std::span<const FlatNode> nodes, const T* constants, T* values, const EvalContext<T>& context,
+                            std::span<const std::uint32_t> slots) {
+    run(nodes, constants, values, context, std::views::iota(std::size_t(0), nodes.size()), slots, [](std::size_t) {});
+}
+
+template<typename T>
+T FlatExpression<T>::apply(const FlatNode& n, const T* values) const {
+    return apply(n, constants_.data(), values);
+}
+
+template<typename T>
+T FlatExpression<T>::apply(const FlatNode& n, const T* constants, const T* values) {
+    using std::sin;
+    using std::cos;
+    using std::log;
+    using std::exp;
+    using std::pow;
+    switch (n.op) {
+    case OpCode::Value:
+        return constants[n.lhs];
+    case OpCode::Variable:
+        break;
+    case OpCode::Add:
+        return values[n.lhs] + values[n.rhs];
+    case OpCode::Sub:
+        return values[n.lhs] - values[n.rhs];
+    case OpCode::Mul:
+        return values[n.lhs] * values[n.rhs];
+    case OpCode::Div:
+        if (values[n.rhs] == T(0)) {
+            throw("Division by zero");
+        }
+        return values[n.lhs] / values[n.rhs];
+    case OpCode::Pow:
+        return pow(values[n.lhs], values[n.rhs]);
+    case OpCode::Sin:
+        return sin(values[n.lhs]);
+    case OpCode::Cos:
+        return cos(values[n.lhs]);
+    case OpCode::Ln:
+        return log(values[n.lhs]);
+    case OpCode::Exp:
+        return exp(values[n.lhs]);
+    }
+    throw("Variable nodes have no operands to apply");
+}
+
+template<typename T>
+const std::vector<FlatNode>& FlatExpression<T>::nodes() const {
+    return nodes_;
+}
+
+template<typename T>
+const std::vector<T>& FlatExpression<T>::constants() const {
+    return constants_;
+}
+
+template<typename T>
+const std::vector<std::uint32_t>& FlatExpression<T>::roots() const {
+    return roots_;
+}
+
+template<typename T>
+std::size_t FlatExpression<T>::size() const {
+    return nodes_.size();
+}
+
+template<typename T>
+std::size_t FlatExpression<T>::hash() const {
+    std::size_t seed = nodes_.size();
+    for (const FlatNode& n : nodes_) {
+        seed = hash_combine(seed, static_cast<std::size_t>(n.op));
+        seed = hash_combine(seed, n.lhs);
+        seed = hash_combine(seed, n.rhs);
+    }
+    for (const T& constant : constants_) {
+        seed = hash_combine(seed, hash_constant(constant));
+    }
+    return seed;
+}
+
+template<typename T>
+bool FlatExpression<T>::operator==(const FlatExpression<T>& that) const {
+    if (nodes_ != that.nodes_ || roots_ != that.roots_ || constants_.size() != that.constants_.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < constants_.size(); ++i) {
+        if (!same_constant(constants_[i], that.constants_[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template class FlatExpression<double>;
+template class FlatExpression<long double>;
+template class FlatExpression<int>;
+template class FlatExpression<std::complex<double>>;
+template class FlatExpression<std::complex<float>>;
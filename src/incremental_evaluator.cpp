@@ -0,0 +1,102 @@
+#include "incremental_evaluator.hpp"
+#include <algorithm>
+#include <string>
+
+template<typename T>
+IncrementalEvaluator<T>::IncrementalEvaluator(const Expression<T>& expr)
+    : flat_(expr), values_(flat_.size()), parents_(flat_.size()), marked_(flat_.size(), 0) {
+    const std::vector<FlatNode>& nodes = flat_.nodes();
+    for (std::uint32_t i = 0; i < nodes.size(); ++i) {
+        const FlatNode& n = nodes[i];
+        switch (n.op) {
+        case OpCode::Value:
+            break;
+        case OpCode::Variable:
+            if (n.lhs >= variables_.size()) {
+                variables_.resize(n.lhs + 1, SymbolTable::npos);
+            }
+            variables_[n.lhs] = i;
+            break;
+        default:
+            parents_[n.lhs].push_back(i);
+            // Add through Pow are the binary operations.
+            if (n.op <= OpCode::Pow && n.rhs != n.lhs) {
+                parents_[n.rhs].push_back(i);
+            }
+            break;
+        }
+        // Nothing has been computed yet.
+        marked_[i] = 1;
+        pending_.push_back(i);
+    }
+}
+
+template<typename T>
+void IncrementalEvaluator<T>::set(std::uint32_t slot, T value) {
+    if (slot >= variables_.size() || variables_[slot] == SymbolTable::npos) {
+        return;
+    }
+    if (inputs_.contains(slot) && inputs_[slot] == value) {
+        return;
+    }
+    inputs_.set(slot, value);
+    mark(variables_[slot]);
+}
+
+template<typename T>
+void IncrementalEvaluator<T>::set(const std::string& name, T value) {
+    std::uint32_t slot = SymbolTable::find(name);
+    if (slot != SymbolTable::npos) {
+        set(slot, value);
+    }
+}
+
+template<typename T>
+void IncrementalEvaluator<T>::mark(std::uint32_t node) {
+    if (marked_[node]) {
+        return;
+    }
+    std::vector<std::uint32_t> stack = {node};
+    marked_[node] = 1;
+    while (!stack.empty()) {
+        std::uint32_t current = stack.back();
+        stack.pop_back();
+        pending_.push_back(current);
+        for (std::uint32_t parent : parents_[current]) {
+            if (!marked_[parent]) {
+                marked_[parent] = 1;
+                stack.push_back(parent);
+            }
+        }
+    }
+}
+
+template<typename T>
+T IncrementalEvaluator<T>::eval() {
+    // Operands precede their parents, so ascending node order is a valid recomputation order.
+    // On a throw the marks stay, and the next eval() retries the same nodes.
+    std::sort(pending_.begin(), pending_.end());
+    FlatExpression<T>::run(flat_.nodes(), flat_.constants().data(), values_.data(), inputs_, pending_, {}, [](std::size_t) {});
+    for (std::uint32_t i : pending_) {
+        marked_[i] = 0;
+    }
+    recomputed_ = pending_.size();
+    pending_.clear();
+    return values_.back();
+}
+
+template<typename T>
+std::size_t IncrementalEvaluator<T>::recomputed() const {
+    return recomputed_;
+}
+
+template<typename T>
+std::size_t IncrementalEvaluator<T>::size() const {
+    return flat_.size();
+}
+
+template class IncrementalEvaluator<double>;
+template class IncrementalEvaluator<long double>;
+template class IncrementalEvaluator<int>;
+template class IncrementalEvaluator<std::complex<double>>;
+template class IncrementalEvaluator<std::complex<float>>;
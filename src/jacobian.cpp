@@ -0,0 +1,219 @@
+#include "jacobian.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// Distinct slots of the variables an expression reads, in increasing order.
+template<typename T>
+std::vector<std::uint32_t> read_slots(const Expression<T>& expr) {
+    std::unordered_set<const ExpressionImpl<T>*> seen;
+    std::vector<std::uint32_t> slots;
+    std::vector<const ExpressionImpl<T>*> stack = {expr.node()};
+    while (!stack.empty()) {
+        const ExpressionImpl<T>* current = stack.back();
+        stack.pop_back();
+        if (!seen.insert(current).second) {
+            continue;
+        }
+        if (current->op() == OpCode::Variable) {
+            slots.push_back(static_cast<const Variable<T>*>(current)->slot());
+        }
+        for (std::size_t i = 0; const Expression<T>* child = current->operand(i); ++i) {
+            stack.push_back(child->node());
+        }
+    }
+    std::sort(slots.begin(), slots.end());
+    return slots;
+}
+
+template<typename T>
+bool is_zero(const Expression<T>& expr) {
+    return expr.node()->op() == OpCode::Value && static_cast<const Value<T>*>(expr.node())->value() == T(0);
+}
+
+// Slot of every column: the given variables, or all the functions read, ordered by name.
+template<typename T>
+std::vector<std::uint32_t> column_slots(const std::vector<Expression<T>>& functions, std::vector<std::string>& variables) {
+    if (variables.empty()) {
+        std::unordered_set<std::uint32_t> all;
+        for (const Expression<T>& function : functions) {
+            for (std::uint32_t slot : read_slots(function)) {
+                if (all.insert(slot).second) {
+                    variables.push_back(SymbolTable::name(slot));
+                }
+            }
+        }
+        std::sort(variables.begin(), variables.end());
+    }
+    std::vector<std::uint32_t> slots;
+    for (const std::string& name : variables) {
+        slots.push_back(SymbolTable::intern(name));
+    }
+    return slots;
+}
+
+}
+
+std::size_t SparsityPattern::nonzeros() const {
+    return column.size();
+}
+
+std::size_t SparsityPattern::find(std::size_t row, std::size_t col) const {
+    if (row >= rows) {
+        return nonzeros();
+    }
+    auto begin = column.begin() + row_begin[row];
+    auto end = column.begin() + row_begin[row + 1];
+    auto found = std::lower_bound(begin, end, col);
+    return found != end && *found == col ? static_cast<std::size_t>(found - column.begin()) : nonzeros();
+}
+
+template<typename T>
+T SparseMatrix<T>::at(std::size_t row, std::size_t column) const {
+    std::size_t index = pattern.find(row, column);
+    return index < values.size() ? values[index] : T(0);
+}
+
+template<typename T>
+std::vector<T> SparseMatrix<T>::dense() const {
+    std::vector<T> result(pattern.rows * pattern.columns, T(0));
+    for (std::size_t row = 0; row < pattern.rows; ++row) {
+        for (std::uint32_t i = pattern.row_begin[row]; i < pattern.row_begin[row + 1]; ++i) {
+            result[row * pattern.columns + pattern.column[i]] = values[i];
+        }
+    }
+    return result;
+}
+
+template<typename T>
+Jacobian<T>::Jacobian(const std::vector<Expression<T>>& functions, std::vector<std::string> variables)
+    : variables_(std::move(variables)) {
+    std::vector<std::uint32_t> slots = column_slots(functions, variables_);
+    std::unordered_map<std::uint32_t, std::uint32_t> column_of;
+    for (std::uint32_t column = 0; column < slots.size(); ++column) {
+        column_of.emplace(slots[column], column);
+    }
+    std::vector<Row> rows(functions.size());
+    for (std::size_t row = 0; row < functions.size(); ++row) {
+        for (std::uint32_t slot : read_slots(functions[row])) {
+            auto found = column_of.find(slot);
+            if (found == column_of.end()) {
+                continue;
+            }
+            Expression<T> partial = functions[row].derivative(slot).simplify();
+            if (!is_zero(partial)) {
+                rows[row].push_back({found->second, partial});
+            }
+        }
+    }
+    build(std::move(rows));
+}
+
+template<typename T>
+Jacobian<T> Jacobian<T>::hessian(const Expression<T>& function, std::vector<std::string> variables) {
+    Jacobian<T> result;
+    result.variables_ = std::move(variables);
+    std::vector<std::uint32_t> slots = column_slots(std::vector<Expression<T>>{function}, result.variables_);
+    std::unordered_map<std::uint32_t, std::uint32_t> column_of;
+    for (std::uint32_t column = 0; column < slots.size(); ++column) {
+        column_of.emplace(slots[column], column);
+    }
+    std::vector<Row> rows(slots.size());
+    for (std::uint32_t row = 0; row < slots.size(); ++row) {
+        Expression<T> gradient = function.derivative(slots[row]).simplify();
+        if (is_zero(gradient)) {
+            continue;
+        }
+        for (std::uint32_t slot : read_slots(gradient)) {
+            auto found = column_of.find(slot);
+            if (found == column_of.end() || found->second > row) {
+                continue;
+            }
+            Expression<T> partial = gradient.derivative(slot).simplify();
+            if (!is_zero(partial)) {
+                rows[row].push_back({found->second, partial});
+                if (found->second != row) {
+                    rows[found->second].push_back({row, partial});
+                }
+            }
+        }
+    }
+    result.build(std::move(rows));
+    return result;
+}
+
+template<typename T>
+void Jacobian<T>::build(std::vector<Row> rows) {
+    pattern_.rows = rows.size();
+    pattern_.columns = variables_.size();
+    pattern_.row_begin = {0};
+    for (Row& row : rows) {
+        std::sort(row.begin(), row.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (auto& [column, partial] : row) {
+            pattern_.column.push_back(column);
+            entries_.push_back(std::move(partial));
+        }
+        pattern_.row_begin.push_back(static_cast<std::uint32_t>(pattern_.column.size()));
+    }
+    // One program for every entry, so nodes shared between entries are evaluated once.
+    flat_ = FlatExpression<T>(std::span<const Expression<T>>(entries_));
+}
+
+template<typename T>
+const SparsityPattern& Jacobian<T>::pattern() const {
+    return pattern_;
+}
+
+template<typename T>
+const std::vector<std::string>& Jacobian<T>::variables() const {
+    return variables_;
+}
+
+template<typename T>
+const std::vector<Expression<T>>& Jacobian<T>::entries() const {
+    return entries_;
+}
+
+template<typename T>
+Expression<T> Jacobian<T>::entry(std::size_t row, std::size_t column) const {
+    std::size_t index = pattern_.find(row, column);
+    return index < entries_.size() ? entries_[index] : Expression<T>(T(0));
+}
+
+template<typename T>
+SparseMatrix<T> Jacobian<T>::eval(const std::map<std::string, T>& context) const {
+    return eval(EvalContext<T>(context));
+}
+
+template<typename T>
+SparseMatrix<T> Jacobian<T>::eval(const EvalContext<T>& context) const {
+    SparseMatrix<T> result = {pattern_, std::vector<T>(pattern_.nonzeros())};
+    eval(context, result.values);
+    return result;
+}
+
+template<typename T>
+void Jacobian<T>::eval(const EvalContext<T>& context, std::span<T> values) const {
+    const std::vector<std::uint32_t>& roots = flat_.roots();
+    if (values.size() != roots.size()) {
+        throw("Expected room for " + std::to_string(roots.size()) + " values, got " + std::to_string(values.size()));
+    }
+    std::vector<T> registers(flat_.size());
+    FlatExpression<T>::run(flat_.nodes(), flat_.constants().data(), registers.data(), context);
+    for (std::size_t i = 0; i < roots.size(); ++i) {
+        values[i] = registers[roots[i]];
+    }
+}
+
+template struct SparseMatrix<double>;
+template struct SparseMatrix<long double>;
+template struct SparseMatrix<int>;
+template struct SparseMatrix<std::complex<double>>;
+template struct SparseMatrix<std::complex<float>>;
+template class Jacobian<double>;
+template class Jacobian<long double>;
+template class Jacobian<int>;
+template class Jacobian<std::complex<double>>;
+template class Jacobian<std::complex<float>>;
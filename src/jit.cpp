@@ -0,0 +1,316 @@
+#include "jit.hpp"
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <utility>
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define EXPRESSION_JIT_X86_64 1
+#endif
+
+namespace {
+
+#ifdef EXPRESSION_JIT_X86_64
+
+class Assembler {
+public:
+    void bytes(std::initializer_list<std::uint8_t> values) {
+        code_.insert(code_.end(), values);
+    }
+
+    void u32(std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            code_.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    void u64(std::uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            code_.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    void patch32(std::size_t at, std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            code_[at + i] = static_cast<std::uint8_t>(value >> (8 * i));
+        }
+    }
+
+    std::size_t size() const {
+        return code_.size();
+    }
+
+    // movsd xmm, [rbx + 8 * reg]
+    void load_register(int xmm, std::uint32_t reg) {
+        bytes({0xF2, 0x0F, 0x10, static_cast<std::uint8_t>(0x83 | (xmm << 3))});
+        u32(8 * reg);
+    }
+
+    // movsd [rbx + 8 * reg], xmm0
+    void store_register(std::uint32_t reg) {
+        bytes({0xF2, 0x0F, 0x11, 0x83});
+        u32(8 * reg);
+    }
+
+    // movsd xmm0, [rbp + 8 * slot]
+    void load_variable(std::uint32_t slot) {
+        bytes({0xF2, 0x0F, 0x10, 0x85});
+        u32(8 * slot);
+    }
+
+    // movsd xmm0, [rip + constant]; the displacement is patched once the pool is placed.
+    void load_constant(std::uint32_t index) {
+        bytes({0xF2, 0x0F, 0x10, 0x05});
+        constant_fixups_.push_back({size(), index});
+        u32(0);
+    }
+
+    // mov rax, function; call rax
+    void call(const void* function) {
+        bytes({0x48, 0xB8});
+        u64(reinterpret_cast<std::uint64_t>(function));
+        bytes({0xFF, 0xD0});
+    }
+
+    // Jumps to the error exit when xmm1 == 0.0; NaN compares unordered and falls through.
+    void check_divisor() {
+        bytes({0x66, 0x0F, 0x57, 0xD2});
+        bytes({0x66, 0x0F, 0x2E, 0xCA});
+        bytes({0x7A, 0x06});
+        bytes({0x0F, 0x84});
+        error_fixups_.push_back(size());
+        u32(0);
+    }
+
+    void prologue() {
+        bytes({0x55});
+        bytes({0x53});
+        bytes({0x48, 0x83, 0xEC, 0x08});
+        bytes({0x48, 0x89, 0xFD});
+        bytes({0x48, 0x89, 0xF3});
+    }
+
+    void epilogue() {
+        bytes({0x48, 0x83, 0xC4, 0x08});
+        bytes({0x5B});
+        bytes({0x5D});
+        bytes({0xC3});
+    }
+
+    // Error exit: mark the status slot and return.
+    void error_exit(std::uint32_t status) {
+        std::size_t target = size();
+        for (std::size_t at : error_fixups_) {
+            patch32(at, static_cast<std::uint32_t>(target - (at + 4)));
+        }
+        bytes({0x48, 0xC7, 0x83});
+        u32(8 * status);
+        u32(1);
+        epilogue();
+    }
+
+    void constant_pool(const std::vector<double>& constants) {
+        while (size() % 8 != 0) {
+            bytes({0xCC});
+        }
+        std::size_t pool = size();
+        for (double constant : constants) {
+            std::uint64_t bits;
+            std::memcpy(&bits, &constant, sizeof(bits));
+            u64(bits);
+        }
+        for (auto [at, index] : constant_fixups_) {
+            patch32(at, static_cast<std::uint32_t>(pool + 8 * index - (at + 4)));
+        }
+    }
+
+    const std::vector<std::uint8_t>& code() const {
+        return code_;
+    }
+private:
+    std::vector<std::uint8_t> code_;
+    std::vector<std::pair<std::size_t, std::uint32_t>> constant_fixups_;
+    std::vector<std::size_t> error_fixups_;
+};
+
+std::vector<std::uint8_t> generate(const CompiledExpression<double>& program) {
+    using Unary = double (*)(double);
+    using Binary = double (*)(double, double);
+    Assembler a;
+    a.prologue();
+    for (const Instruction& ins : program.code()) {
+        switch (ins.op) {
+        case OpCode::Value:
+            a.load_constant(ins.lhs);
+            break;
+        case OpCode::Variable:
+            a.load_variable(ins.lhs);
+            break;
+        case OpCode::Add:
+            a.load_register(0, ins.lhs);
+            a.load_register(1, ins.rhs);
+            a.bytes({0xF2, 0x0F, 0x58, 0xC1});
+            break;
+        case OpCode::Sub:
+            a.load_register(0, ins.lhs);
+            a.load_register(1, ins.rhs);
+            a.bytes({0xF2, 0x0F, 0x5C, 0xC1});
+            break;
+        case OpCode::Mul:
+            a.load_register(0, ins.lhs);
+            a.load_register(1, ins.rhs);
+            a.bytes({0xF2, 0x0F, 0x59, 0xC1});
+            break;
+        case OpCode::Div:
+            a.load_register(0, ins.lhs);
+            a.load_register(1, ins.rhs);
+            a.check_divisor();
+            a.bytes({0xF2, 0x0F, 0x5E, 0xC1});
+            break;
+        case OpCode::Pow:
+            a.load_register(0, ins.lhs);
+            a.load_register(1, ins.rhs);
+            a.call(reinterpret_cast<const void*>(static_cast<Binary>(&::pow)));
+            break;
+        case OpCode::Sin:
+            a.load_register(0, ins.lhs);
+            a.call(reinterpret_cast<const void*>(static_cast<Unary>(&::sin)));
+            break;
+        case OpCode::Cos:
+            a.load_register(0, ins.lhs);
+            a.call(reinterpret_cast<const void*>(static_cast<Unary>(&::cos)));
+            break;
+        case OpCode::Ln:
+            a.load_register(0, ins.lhs);
+            a.call(reinterpret_cast<const void*>(static_cast<Unary>(&::log)));
+            break;
+        case OpCode::Exp:
+            a.load_register(0, ins.lhs);
+            a.call(reinterpret_cast<const void*>(static_cast<Unary>(&::exp)));
+            break;
+        }
+        a.store_register(ins.dst);
+    }
+    a.load_register(0, program.result());
+    a.epilogue();
+    a.error_exit(program.registers());
+    a.constant_pool(program.constants());
+    return a.code();
+}
+
+#endif
+
+}
+
+JitExpression::JitExpression(const Expression<double>& expr) : JitExpression(expr.compile()) {}
+
+JitExpression::JitExpression(const CompiledExpression<double>& program)
+    : registers_(program.registers()), slots_(program.slots()) {
+#ifdef EXPRESSION_JIT_X86_64
+    std::vector<std::uint8_t> code = generate(program);
+    std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    mapped_ = (code.size() + page - 1) / page * page;
+    void* pages = mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) {
+        throw("Cannot map memory for generated code");
+    }
+    std::memcpy(pages, code.data(), code.size());
+    if (mprotect(pages, mapped_, PROT_READ | PROT_EXEC) != 0) {
+        munmap(pages, mapped_);
+        throw("Cannot make generated code executable");
+    }
+    pages_ = pages;
+    code_size_ = code.size();
+    function_ = reinterpret_cast<Function>(pages);
+#else
+    throw("The JIT is not available on this target");
+#endif
+}
+
+JitExpression::JitExpression(JitExpression&& moved)
+    : pages_(std::exchange(moved.pages_, nullptr)),
+      mapped_(std::exchange(moved.mapped_, 0)),
+      code_size_(std::exchange(moved.code_size_, 0)),
+      function_(std::exchange(moved.function_, nullptr)),
+      registers_(moved.registers_),
+      slots_(std::move(moved.slots_)) {}
+
+JitExpression& JitExpression::operator=(JitExpression&& that) {
+    if (this == &that) {
+        return *this;
+    }
+    release();
+    pages_ = std::exchange(that.pages_, nullptr);
+    mapped_ = std::exchange(that.mapped_, 0);
+    code_size_ = std::exchange(that.code_size_, 0);
+    function_ = std::exchange(that.function_, nullptr);
+    registers_ = that.registers_;
+    slots_ = std::move(that.slots_);
+    return *this;
+}
+
+JitExpression::~JitExpression() {
+    release();
+}
+
+void JitExpression::release() {
+#ifdef EXPRESSION_JIT_X86_64
+    if (pages_) {
+        munmap(pages_, mapped_);
+    }
+#endif
+    pages_ = nullptr;
+    function_ = nullptr;
+}
+
+bool JitExpression::supported() {
+#ifdef EXPRESSION_JIT_X86_64
+    return true;
+#else
+    return false;
+#endif
+}
+
+double JitExpression::eval(const std::map<std::string, double>& context) const {
+    return eval(EvalContext<double>(context));
+}
+
+double JitExpression::eval(const EvalContext<double>& context) const {
+    for (std::uint32_t slot : slots_) {
+        if (!context.contains(slot)) {
+            throw("The variable \"" + SymbolTable::name(slot) + "\" is undefined\n");
+        }
+    }
+    constexpr std::size_t inline_registers = 64;
+    if (scratch_size() <= inline_registers) {
+        std::array<double, inline_registers> registers;
+        return run(context.values().data(), registers.data());
+    }
+    std::vector<double> registers(scratch_size());
+    return run(context.values().data(), registers.data());
+}
+
+double JitExpression::eval(std::span<const double> values) const {
+    return eval(EvalContext<double>(values));
+}
+
+double JitExpression::run(const double* variables, double* registers) const {
+    std::uint64_t status = 0;
+    std::memcpy(&registers[registers_], &status, sizeof(status));
+    double result = function_(variables, registers);
+    std::memcpy(&status, &registers[registers_], sizeof(status));
+    if (status != 0) {
+        throw("Division by zero");
+    }
+    return result;
+}
+
+std::size_t JitExpression::scratch_size() const {
+    return static_cast<std::size_t>(registers_) + 1;
+}
+
+std::size_t JitExpression::code_size() const {
+    return code_size_;
+}
@@ -0,0 +1,200 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <map>
+#include <ranges>
+
+namespace {
+
+const char* op_name(OpCode op) {
+    switch (op) {
+    case OpCode::Value:
+        return "value";
+    case OpCode::Variable:
+        return "variable";
+    case OpCode::Add:
+        return "+";
+    case OpCode::Sub:
+        return "-";
+    case OpCode::Mul:
+        return "*";
+    case OpCode::Div:
+        return "/";
+    case OpCode::Pow:
+        return "^";
+    case OpCode::Sin:
+        return "sin";
+    case OpCode::Cos:
+        return "cos";
+    case OpCode::Ln:
+        return "ln";
+    case OpCode::Exp:
+        return "exp";
+    }
+    return "?";
+}
+
+bool is_binary(OpCode op) {
+    return op == OpCode::Add || op == OpCode::Sub || op == OpCode::Mul || op == OpCode::Div || op == OpCode::Pow;
+}
+
+bool is_leaf(OpCode op) {
+    return op == OpCode::Value || op == OpCode::Variable;
+}
+
+template<typename T>
+std::string shorten(const Expression<T>& expr, std::size_t max_length) {
+    std::string text = expr.to_string(max_length + 1);
+    if (text.size() > max_length) {
+        text = text.substr(0, max_length > 3 ? max_length - 3 : 0) + "...";
+    }
+    return text;
+}
+
+}
+
+template<typename T>
+ExpressionProfiler<T>::ExpressionProfiler(const Expression<T>& expr)
+    : flat_(expr), values_(flat_.size()), calls_(flat_.size(), 0), nanoseconds_(flat_.size(), 0),
+      bytes_(expr.memory_bytes()) {}
+
+template<typename T>
+T ExpressionProfiler<T>::eval(const std::map<std::string, T>& context) {
+    return eval(EvalContext<T>(context));
+}
+
+template<typename T>
+T ExpressionProfiler<T>::eval(const EvalContext<T>& context) {
+    using clock = std::chrono::steady_clock;
+    const std::vector<FlatNode>& nodes = flat_.nodes();
+    auto begin = clock::now();
+    auto last = begin;
+    // One clock read per node: the interval since the previous read is this node's time.
+    FlatExpression<T>::run(nodes, flat_.constants().data(), values_.data(), context,
+                           std::views::iota(std::size_t(0), nodes.size()), {}, [&](std::size_t i) {
+        auto now = clock::now();
+        ++calls_[i];
+        nanoseconds_[i] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        last = now;
+    });
+    ++evals_;
+    total_ += std::chrono::duration_cast<std::chrono::nanoseconds>(last - begin).count();
+    return values_.back();
+}
+
+template<typename T>
+void ExpressionProfiler<T>::reset() {
+    std::fill(calls_.begin(), calls_.end(), 0);
+    std::fill(nanoseconds_.begin(), nanoseconds_.end(), 0);
+    evals_ = 0;
+    total_ = 0;
+}
+
+template<typename T>
+std::vector<NodeProfile> ExpressionProfiler<T>::nodes() const {
+    // The flat nodes are in post-order, so one forward pass finishes every node's totals
+    // before they are added to its owner, the first parent that reads it. Node 0 is a leaf,
+    // so owner 0 means none.
+    const std::vector<FlatNode>& nodes = flat_.nodes();
+    std::vector<NodeProfile> profiles(nodes.size());
+    std::vector<std::uint32_t> owner(nodes.size(), 0);
+    for (std::uint32_t i = 0; i < nodes.size(); ++i) {
+        const FlatNode& n = nodes[i];
+        profiles[i] = {i, n.op, calls_[i], nanoseconds_[i], 0, 0};
+        if (!is_leaf(n.op) && owner[n.lhs] == 0) {
+            owner[n.lhs] = i;
+        }
+        if (is_binary(n.op) && owner[n.rhs] == 0) {
+            owner[n.rhs] = i;
+        }
+    }
+    for (std::uint32_t i = 0; i < nodes.size(); ++i) {
+        profiles[i].total_nanoseconds += nanoseconds_[i];
+        ++profiles[i].subtree_nodes;
+        if (owner[i] != 0) {
+            profiles[owner[i]].total_nanoseconds += profiles[i].total_nanoseconds;
+            profiles[owner[i]].subtree_nodes += profiles[i].subtree_nodes;
+        }
+    }
+    return profiles;
+}
+
+template<typename T>
+std::vector<OperatorProfile> ExpressionProfiler<T>::operators() const {
+    std::map<OpCode, OperatorProfile> by_op;
+    const std::vector<FlatNode>& nodes = flat_.nodes();
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        OperatorProfile& profile = by_op.try_emplace(nodes[i].op, OperatorProfile{nodes[i].op, 0, 0, 0}).first->second;
+        ++profile.nodes;
+        profile.calls += calls_[i];
+        profile.nanoseconds += nanoseconds_[i];
+    }
+    std::vector<OperatorProfile> result;
+    for (const auto& [op, profile] : by_op) {
+        result.push_back(profile);
+    }
+    return result;
+}
+
+template<typename T>
+ProfileStats ExpressionProfiler<T>::stats() const {
+    const std::vector<FlatNode>& nodes = flat_.nodes();
+    std::vector<std::size_t> depth(nodes.size(), 1);
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        if (!is_leaf(nodes[i].op)) {
+            depth[i] = 1 + depth[nodes[i].lhs];
+            if (is_binary(nodes[i].op)) {
+                depth[i] = std::max(depth[i], 1 + depth[nodes[i].rhs]);
+            }
+        }
+    }
+    double seconds = total_ * 1e-9;
+    return {nodes.size(), depth.back(), bytes_, evals_, total_, seconds > 0 ? evals_ / seconds : 0.0};
+}
+
+template<typename T>
+std::string ExpressionProfiler<T>::describe(std::uint32_t node, std::size_t max_length) const {
+    return shorten(flat_.expressions().at(node), max_length);
+}
+
+template<typename T>
+std::string ExpressionProfiler<T>::report(std::size_t top) const {
+    ProfileStats s = stats();
+    std::string out;
+    char line[256];
+    std::snprintf(line, sizeof(line), "nodes %zu, depth %zu, bytes %zu, evals %llu, %.6g evals/s\n",
+                  s.nodes, s.depth, s.bytes, static_cast<unsigned long long>(s.evals), s.evals_per_second);
+    out += line;
+    double total = s.nanoseconds > 0 ? static_cast<double>(s.nanoseconds) : 1.0;
+    out += "\noperator      nodes        calls      time ns   share\n";
+    for (const OperatorProfile& p : operators()) {
+        std::snprintf(line, sizeof(line), "%-9s %9llu %12llu %12llu  %5.1f%%\n", op_name(p.op),
+                      static_cast<unsigned long long>(p.nodes), static_cast<unsigned long long>(p.calls),
+                      static_cast<unsigned long long>(p.nanoseconds), 100.0 * p.nanoseconds / total);
+        out += line;
+    }
+    std::vector<NodeProfile> profiles = nodes();
+    std::sort(profiles.begin(), profiles.end(), [](const NodeProfile& a, const NodeProfile& b) {
+        return a.total_nanoseconds != b.total_nanoseconds ? a.total_nanoseconds > b.total_nanoseconds : a.node > b.node;
+    });
+    std::vector<Expression<T>> expressions = flat_.expressions();
+    out += "\n    node  op          self ns     total ns   share  subtree  expression\n";
+    for (std::size_t i = 0; i < std::min(top, profiles.size()); ++i) {
+        const NodeProfile& p = profiles[i];
+        std::snprintf(line, sizeof(line), "%8u  %-8s %10llu %12llu  %5.1f%% %8u  ", p.node, op_name(p.op),
+                      static_cast<unsigned long long>(p.self_nanoseconds), static_cast<unsigned long long>(p.total_nanoseconds),
+                      100.0 * p.total_nanoseconds / total, p.subtree_nodes);
+        out += line;
+        out += shorten(expressions[p.node], 60);
+        out += '\n';
+    }
+    return out;
+}
+
+template class ExpressionProfiler<double>;
+template class ExpressionProfiler<long double>;
+template class ExpressionProfiler<int>;
+template class ExpressionProfiler<std::complex<double>>;
+template class ExpressionProfiler<std::complex<float>>;
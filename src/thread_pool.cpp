@@ -0,0 +1,122 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(std::size_t threads) {
+    threads = std::max<std::size_t>(threads, 1);
+    for (std::size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+std::size_t ThreadPool::size() const {
+    return threads_.size();
+}
+
+void ThreadPool::parallel_for(std::size_t chunks, const Task& task) {
+    if (chunks == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> run(run_mutex_);
+    {
+        // Set before any chunk is visible: a worker still draining may pick one up immediately.
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_ = chunks;
+        error_ = nullptr;
+    }
+    // Contiguous runs of chunks per worker keep neighbouring rows on one core until stealing starts.
+    std::size_t workers = queues_.size();
+    for (std::size_t w = 0; w < workers; ++w) {
+        std::size_t begin = chunks * w / workers;
+        std::size_t end = chunks * (w + 1) / workers;
+        std::lock_guard<std::mutex> lock(queues_[w]->mutex);
+        for (std::size_t chunk = begin; chunk < end; ++chunk) {
+            queues_[w]->items.push_back({&task, chunk});
+        }
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++generation_;
+    wake_.notify_all();
+    done_.wait(lock, [this] { return pending_ == 0; });
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+bool ThreadPool::take(std::size_t worker, Item& item) {
+    {
+        Queue& own = *queues_[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.items.empty()) {
+            item = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+    for (std::size_t i = 1; i < queues_.size(); ++i) {
+        Queue& victim = *queues_[(worker + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.items.empty()) {
+            item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::finish(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error && !error_) {
+        error_ = error;
+    }
+    if (--pending_ == 0) {
+        done_.notify_all();
+    }
+}
+
+void ThreadPool::work(std::size_t worker) {
+    std::size_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+        }
+        Item item;
+        while (take(worker, item)) {
+            bool failed;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                failed = error_ != nullptr;
+            }
+            std::exception_ptr error;
+            if (!failed) {
+                try {
+                    (*item.task)(item.chunk, worker);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+            finish(error);
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs the differentiator CLI on malformed input: every case must print an error and exit
+# with status 1 instead of aborting. Usage: tests/cli_test.sh <differentiator>
+exe=${1:-./differentiator}
+failed=0
+
+expect_error() {
+    output=$("$exe" "$@" 2>&1)
+    status=$?
+    if [ "$status" -eq 1 ] && [ -n "$output" ]; then
+        echo "[OK] $*"
+    else
+        echo "[FAIL] $* - exit status $status"
+        failed=1
+    fi
+}
+
+expect_error eval "2x" x=1
+expect_error eval "foo(x)" x=1
+expect_error eval "x+" x=1
+expect_error eval "x*(y" x=1 y=2
+expect_error eval "x*y" x=1
+expect_error diff "x*(y" by x
+expect_error diff "2x" by x
+expect_error --shared diff "x+" by x
+expect_error --profile eval "x+" x=1
+
+exit $failed
@@ -1,10 +1,22 @@
 #include "expression.hpp"
+#include "thread_pool.hpp"
+#include "jit.hpp"
+#include "flat_expression.hpp"
+#include "static_expression.hpp"
+#include "incremental_evaluator.hpp"
+#include "expression_file.hpp"
+#include "profiler.hpp"
+#include "jacobian.hpp"
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <cstring>
+#include <new>
 #include <cmath>
+#include <random>
 
 #define RUN_TEST(test) \
     try { \
@@ -19,6 +31,25 @@
         throw std::runtime_error("Assertion failed: " #condition); \
     }
 
+// Counts heap allocations so tests can check that a call does not allocate.
+std::atomic<std::size_t> allocations = 0;
+
+void* operator new(std::size_t size) {
+    ++allocations;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
 void test_creation_from_string1() {
     Expression<long double> expr1("1");
     ASSERT(expr1.to_string() == std::to_string(1.0));
@@ -323,7 +354,7 @@ void test_diff_var1() {
 
 void test_diff_var2() {
     Expression<long double> expr("x");
-    ASSERT(expr.diff("x") == "1");
+    ASSERT(expr.diff("x") == std::to_string((long double)1.0));
 }
 
 void test_eval_add1() {
@@ -355,7 +386,7 @@ void test_diff_add1() {
 
 void test_diff_add2() {
     Expression<long double> expr("x + y");
-    ASSERT(expr.diff("x") == "(1 + 0)");
+    ASSERT(expr.diff("x") == "(1.000000 + 0.000000)");
 }
 
 void test_eval_sub1() {
@@ -387,7 +418,7 @@ void test_diff_sub1() {
 
 void test_diff_sub2() {
     Expression<long double> expr("x - y");
-    ASSERT(expr.diff("x") == "(1 - 0)");
+    ASSERT(expr.diff("x") == "(1.000000 - 0.000000)");
 }
 
 void test_eval_mul1() {
@@ -414,12 +445,12 @@ void test_to_string_mul2() {
 
 void test_diff_mul1() {
     Expression<int> expr("1 * 1");
-    ASSERT(expr.diff("") == "(1 * 0 + 0 * 1)");
+    ASSERT(expr.diff("") == "((1 * 0) + (0 * 1))");
 }
 
 void test_diff_mul2() {
     Expression<long double> expr("x * y");
-    ASSERT(expr.diff("x") == "(x * 0 + 1 * y)");
+    ASSERT(expr.diff("x") == "((x * 0.000000) + (1.000000 * y))");
 }
 
 void test_eval_div1() {
@@ -446,12 +477,12 @@ void test_to_string_div2() {
 
 void test_diff_div1() {
     Expression<int> expr("1 / 1");
-    ASSERT(expr.diff("") == "((0 * 1 - 1 * 0) / (1 ^ 2))");
+    ASSERT(expr.diff("") == "(((0 * 1) - (1 * 0)) / (1 ^ 2))");
 }
 
 void test_diff_div2() {
     Expression<long double> expr("x / y");
-    ASSERT(expr.diff("x") == "((1 * y - x * 0) / (y ^ 2))");
+    ASSERT(expr.diff("x") == "(((1.000000 * y) - (x * 0.000000)) / (y ^ 2.000000))");
 }
 
 void test_eval_pow1() {
@@ -478,12 +509,12 @@ void test_to_string_pow2() {
 
 void test_diff_pow1() {
     Expression<int> expr("1 ^ 1");
-    ASSERT(expr.diff("") == "(1 * (1 ^ (1 - 1)) * 0)");
+    ASSERT(expr.diff("") == "((1 * (1 ^ (1 - 1))) * 0)");
 }
 
 void test_diff_pow2() {
     Expression<int> expr("x ^ y");
-    ASSERT(expr.diff("x") == "(y * (x ^ (y - 1)) * 1)");
+    ASSERT(expr.diff("x") == "((y * (x ^ (y - 1))) * 1)");
 }
 
 void test_eval_sin1() {
@@ -515,7 +546,7 @@ void test_diff_sin1() {
 
 void test_diff_sin2() {
     Expression<long double> expr("sin(x)");
-    ASSERT(expr.diff("x") == "(cos(x) * 1)");
+    ASSERT(expr.diff("x") == "(cos(x) * 1.000000)");
 }
 
 void test_eval_cos1() {
@@ -542,12 +573,12 @@ void test_to_string_cos2() {
 
 void test_diff_cos1() {
     Expression<int> expr("cos(1)");
-    ASSERT(expr.diff("") == "(-sin(1) * 0)");
+    ASSERT(expr.diff("") == "((0 - sin(1)) * 0)");
 }
 
 void test_diff_cos2() {
     Expression<long double> expr("cos(x)");
-    ASSERT(expr.diff("x") == "(-sin(x) * 1)");
+    ASSERT(expr.diff("x") == "((0.000000 - sin(x)) * 1.000000)");
 }
 
 void test_eval_ln1() {
@@ -574,12 +605,12 @@ void test_to_string_ln2() {
 
 void test_diff_ln1() {
     Expression<int> expr("ln(1)");
-    ASSERT(expr.diff("") == "(0/1)");
+    ASSERT(expr.diff("") == "(0 / 1)");
 }
 
 void test_diff_ln2() {
     Expression<long double> expr("ln(x)");
-    ASSERT(expr.diff("x") == "(1/x)");
+    ASSERT(expr.diff("x") == "(1.000000 / x)");
 }
 
 void test_eval_exp1() {
@@ -611,7 +642,964 @@ void test_diff_exp1() {
 
 void test_diff_exp2() {
     Expression<long double> expr("exp(x)");
-    ASSERT(expr.diff("x") == "(exp(x) * 1)");
+    ASSERT(expr.diff("x") == "(exp(x) * 1.000000)");
+}
+
+void test_compile1() {
+    Expression<long double> expr("x * sin(y) + 2 ^ x - ln(y) / exp(x)");
+    std::map<std::string, long double> context = {{"x", 1.5}, {"y", 0.5}};
+    ASSERT(expr.compile().eval(context) == expr.eval(context));
+}
+
+void test_compile2() {
+    Expression<int> expr("x * y - 10 / x");
+    std::map<std::string, int> context = {{"x", 2}, {"y", 7}};
+    ASSERT(expr.compile().eval(context) == 9);
+}
+
+void test_compile3() {
+    Expression<long double> expr("x + y + x * y");
+    CompiledExpression<long double> program = expr.compile();
+    ASSERT(program.variables().size() == 2);
+    ASSERT(program.registers() < program.code().size());
+}
+
+void test_compile4() {
+    // Lowering walks the tree with an explicit stack, so a 100000-term chain compiles.
+    std::string text = "x";
+    long double expected = 1;
+    for (int i = 0; i < 100000; ++i) {
+        text += " + x * " + std::to_string(i % 7);
+        expected += i % 7;
+    }
+    Expression<long double> expr(text);
+    CompiledExpression<long double> program = expr.compile();
+    ASSERT(program.registers() < 16);
+    std::vector<long double> x = {1, 2};
+    std::vector<long double> out(2);
+    expr.eval_batch({{"x", x.data()}}, 2, out.data());
+    ASSERT(out[0] == expected);
+    ASSERT(out[1] == 2 * expected);
+}
+
+void test_eval_context1() {
+    Expression<long double> expr("x * y + x");
+    EvalContext<long double> context;
+    context.set("x", 2.0);
+    context.set("y", 3.0);
+    ASSERT(expr.eval(context) == (long double)8);
+    context.set("y", 4.0);
+    ASSERT(expr.eval(context) == (long double)10);
+    ASSERT(expr.compile().eval(context) == (long double)10);
+}
+
+void test_eval_context2() {
+    Expression<int> expr("a - b");
+    std::vector<int> values(SymbolTable::size());
+    values[SymbolTable::find("a")] = 7;
+    values[SymbolTable::find("b")] = 5;
+    ASSERT(expr.eval(std::span<const int>(values)) == 2);
+    ASSERT(expr.compile().eval(std::span<const int>(values)) == 2);
+}
+
+void test_eval_context3() {
+    Expression<double> expr("x * sin(y) + x / y - exp(y) ^ 2 + (x * y) * (x * y)");
+    EvalContext<double> context;
+    context.set("x", 1.5);
+    context.set("y", 0.5);
+    double expected = expr.eval(context);
+    std::size_t before = allocations;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT(expr.eval(context) == expected);
+    }
+    ASSERT(allocations == before);
+}
+
+void test_eval_context4() {
+    // Every level reads the one below three times, so a walk that does not reuse the values
+    // of shared nodes would visit 3^80 of them.
+    Expression<double> expr("x");
+    for (int i = 0; i < 80; ++i) {
+        expr = sin(expr) * cos(expr) + expr;
+    }
+    EvalContext<double> context;
+    context.set("x", 0.25);
+    ASSERT(expr.eval(context) == expr.compile().eval(context));
+}
+
+void test_eval_batch1() {
+    Expression<double> expr("x * sin(y) + x / y - exp(y) ^ 2");
+    std::vector<double> x(1000), y(1000), out(1000);
+    for (std::size_t i = 0; i < x.size(); ++i) {
+        x[i] = 0.5 + i;
+        y[i] = 1.0 + 0.01 * i;
+    }
+    expr.eval_batch({{"x", x.data()}, {"y", y.data()}}, x.size(), out.data());
+    for (std::size_t i = 0; i < x.size(); ++i) {
+        std::map<std::string, double> context = {{"x", x[i]}, {"y", y[i]}};
+        ASSERT(std::abs(out[i] - expr.eval(context)) <= 1e-12 * std::abs(out[i]));
+    }
+}
+
+void test_eval_batch2() {
+    Expression<int> expr("a * 3 - b");
+    std::vector<int> a = {1, 2, 3}, b = {1, 1, 1}, out(3);
+    expr.eval_batch({{"a", a.data()}, {"b", b.data()}}, a.size(), out.data());
+    ASSERT(out[0] == 2 && out[1] == 5 && out[2] == 8);
+}
+
+void test_eval_batch3() {
+    // Every packed kernel the CPU supports against the scalar loop, over a length that leaves
+    // a tail in the last block. Packed complex division skips the scaling std::complex applies,
+    // so it may differ from it in the last bits.
+    using C = std::complex<double>;
+    std::mt19937 random(7);
+    std::uniform_real_distribution<double> uniform(-4.0, 4.0);
+    std::size_t n = 3 * CompiledExpression<double>::batch_block + 7;
+    std::vector<double> x(n), y(n), out(n), scalar(n);
+    std::vector<C> cx(n), cy(n), cout(n), cscalar(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        x[i] = uniform(random);
+        y[i] = uniform(random);
+        cx[i] = C(uniform(random), uniform(random));
+        cy[i] = C(uniform(random), uniform(random));
+    }
+    BatchKernels supported = batch_kernels();
+    for (std::string text : {"x + y", "x - y", "x * y", "x / y"}) {
+        Expression<double> real(text);
+        Expression<C> complex(text);
+        ASSERT(set_batch_kernels(BatchKernels::Scalar));
+        real.eval_batch({{"x", x.data()}, {"y", y.data()}}, n, scalar.data());
+        complex.eval_batch({{"x", cx.data()}, {"y", cy.data()}}, n, cscalar.data());
+        for (BatchKernels kernels : {BatchKernels::Sse2, BatchKernels::Avx2}) {
+            if (!set_batch_kernels(kernels)) {
+                ASSERT(kernels > supported);
+                continue;
+            }
+            real.eval_batch({{"x", x.data()}, {"y", y.data()}}, n, out.data());
+            ASSERT(out == scalar);
+            complex.eval_batch({{"x", cx.data()}, {"y", cy.data()}}, n, cout.data());
+            for (std::size_t i = 0; i < n; ++i) {
+                ASSERT(text == "x / y" ? std::abs(cout[i] - cscalar[i]) <= 1e-15 * std::abs(cscalar[i]) : cout[i] == cscalar[i]);
+            }
+        }
+    }
+    ASSERT(set_batch_kernels(supported));
+}
+
+void test_eval_batch_parallel1() {
+    Expression<double> expr("x * x - 3 * x + cos(x)");
+    std::vector<double> x(100000), serial(x.size()), parallel(x.size());
+    for (std::size_t i = 0; i < x.size(); ++i) {
+        x[i] = 0.001 * i;
+    }
+    ThreadPool pool(4);
+    expr.eval_batch({{"x", x.data()}}, x.size(), serial.data());
+    expr.eval_batch({{"x", x.data()}}, x.size(), parallel.data(), pool);
+    ASSERT(serial == parallel);
+}
+
+void test_eval_batch_parallel2() {
+    Expression<long double> expr("1 / x");
+    std::vector<long double> x(50000, 1.0), out(x.size());
+    x[31337] = 0.0;
+    ThreadPool pool(3);
+    bool thrown = false;
+    try {
+        expr.eval_batch({{"x", x.data()}}, x.size(), out.data(), pool);
+    } catch (const char*) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    x[31337] = 2.0;
+    expr.eval_batch({{"x", x.data()}}, x.size(), out.data(), pool);
+    ASSERT(out[31337] == (long double)0.5 && out[0] == (long double)1);
+}
+
+void test_parse1() {
+    Expression<int> expr("10 - 2 - 3 + 100 / 10 / 5 * 2");
+    std::map<std::string, int> context;
+    ASSERT(expr.eval(context) == 9);
+    ASSERT(Expression<int>("2 ^ 3 ^ 2").eval(context) == 512);
+}
+
+void test_parse2() {
+    Expression<long double> expr("((x))");
+    ASSERT(expr.to_string() == "x");
+    Expression<long double> neg("-x ^ 2 + 2 * -x");
+    std::map<std::string, long double> context = {{"x", 3.0}};
+    ASSERT(neg.eval(context) == (long double)-15);
+    ASSERT(Expression<long double>("2.5e1").eval(context) == (long double)25);
+}
+
+void test_parse3() {
+    std::string text = "x";
+    long double expected = 1;
+    for (int i = 0; i < 20000; ++i) {
+        text += " + x * " + std::to_string(i % 7);
+        expected += i % 7;
+    }
+    Expression<long double> expr(text);
+    std::map<std::string, long double> context = {{"x", 1.0}};
+    ASSERT(expr.eval(context) == expected);
+}
+
+void test_parse4() {
+    bool thrown = false;
+    try {
+        Expression<long double> expr("(x + 1");
+    } catch (const char* e) {
+        thrown = std::string(e) == "parenthesis missmatch";
+    }
+    ASSERT(thrown);
+    thrown = false;
+    try {
+        Expression<long double> expr("foo(x)");
+    } catch (const std::string&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void test_parse5() {
+    // Nesting is held on the parser's own stack, and eval walks the tree iteratively.
+    std::string text;
+    for (int i = 0; i < 100000; ++i) {
+        text += i % 2 ? "-(" : "ln(exp(";
+    }
+    text += "x";
+    for (int i = 0; i < 100000; ++i) {
+        text += i % 2 ? ")" : "))";
+    }
+    Expression<long double> expr(text);
+    std::map<std::string, long double> context = {{"x", 0.5}};
+    ASSERT(std::abs(expr.eval(context) - 0.5) < 1e-9);
+    ASSERT(expr.simplify().to_string() == "x");
+}
+
+void test_derivative1() {
+    Expression<long double> expr("x * sin(x) + y / x");
+    Expression<long double> d = expr.derivative("x");
+    Expression<long double> dd = d.derivative("x");
+    std::map<std::string, long double> context = {{"x", 2.0}, {"y", 3.0}};
+    long double x = 2.0, y = 3.0;
+    ASSERT(std::abs(d.eval(context) - (std::sin(x) + x * std::cos(x) - y / (x * x))) < 1e-12);
+    ASSERT(std::abs(dd.eval(context) - (2 * std::cos(x) - x * std::sin(x) + 2 * y / (x * x * x))) < 1e-12);
+}
+
+void test_derivative2() {
+    Expression<long double> expr("x ^ x");
+    std::map<std::string, long double> context = {{"x", 2.0}};
+    ASSERT(std::abs(expr.derivative("x").eval(context) - 4 * (std::log((long double)2.0) + 1)) < 1e-12);
+    ASSERT(expr.derivative("z").eval(context) == (long double)0);
+}
+
+void test_derivative3() {
+    // 2n + 1 distinct nodes, but 2^n paths from the root to x.
+    Expression<long double> expr("x");
+    for (int i = 0; i < 60; ++i) {
+        expr = sin(expr) * cos(expr);
+    }
+    Expression<long double> derivative = expr.derivative("x");
+    ASSERT(FlatExpression<long double>(derivative).size() < 20 * 60);
+    std::map<std::string, long double> context = {{"x", 0.5}};
+    long double expected = expr.eval_with_derivative(context, "x").derivative;
+    ASSERT(std::abs(derivative.compile().eval(EvalContext<long double>(context)) - expected) < 1e-12);
+    ASSERT(expr.depends_on(SymbolTable::find("x")));
+    ASSERT(!expr.depends_on(SymbolTable::intern("y")));
+}
+
+void test_hash_consing1() {
+    Expression<long double> expr1("x + sin(y) * x");
+    Expression<long double> x("x");
+    Expression<long double> y("y");
+    Expression<long double> expr2 = x + sin(y) * x;
+    ASSERT(expr1 == expr2);
+    ASSERT(expr1.hash() == expr2.hash());
+    ASSERT(!(expr1 == Expression<long double>("x + sin(y) * y")));
+    ASSERT(!(Expression<long double>(0.0) == Expression<long double>(-0.0)));
+}
+
+void test_hash_consing2() {
+    Expression<long double> expr("sin(x) * sin(x) + sin(x)");
+    CompiledExpression<long double> program = expr.compile();
+    ASSERT(program.code().size() == 4);
+    std::map<std::string, long double> context = {{"x", 0.5}};
+    ASSERT(program.eval(context) == expr.eval(context));
+}
+
+void test_simplify1() {
+    ASSERT(Expression<long double>("x * 1 + 0").simplify().to_string() == "x");
+    ASSERT(Expression<long double>("(x - x) * y + 2 * 3").simplify().to_string() == std::to_string(6.0));
+    ASSERT(Expression<long double>("ln(exp(x ^ 1))").simplify().to_string() == "x");
+    ASSERT(Expression<int>("0 - (0 - x)").simplify().to_string() == "x");
+    ASSERT(Expression<int>("y * x + 2").simplify() == Expression<int>("2 + x * y").simplify());
+}
+
+void test_simplify2() {
+    Expression<long double> expr("x * sin(x) + y / x");
+    Expression<long double> d = expr.derivative("x");
+    Expression<long double> simple = d.simplify();
+    std::map<std::string, long double> context = {{"x", 2.0}, {"y", 3.0}};
+    ASSERT(simple.eval(context) == d.eval(context));
+    ASSERT(simple.compile().code().size() < d.compile().code().size());
+    ASSERT(Expression<long double>("sin(x)").derivative("x").simplify().to_string() == "cos(x)");
+}
+
+void test_eval_with_derivative1() {
+    Expression<long double> expr("x * sin(y) + exp(x) / y - ln(x) * cos(x)");
+    std::map<std::string, long double> context = {{"x", 1.5}, {"y", 0.5}};
+    Dual<long double> dx = expr.eval_with_derivative(context, "x");
+    Dual<long double> dy = expr.eval_with_derivative(context, "y");
+    ASSERT(dx.value == expr.eval(context));
+    ASSERT(std::abs(dx.derivative - expr.derivative("x").eval(context)) < 1e-12);
+    ASSERT(std::abs(dy.derivative - expr.derivative("y").eval(context)) < 1e-12);
+}
+
+void test_eval_with_derivative2() {
+    Expression<long double> expr("x ^ 3 + 2 ^ x + x ^ x");
+    std::map<std::string, long double> context = {{"x", 2.0}};
+    Dual<long double> d = expr.eval_with_derivative(context, "x");
+    long double expected = 12 + 4 * std::log((long double)2.0) + 4 * (std::log((long double)2.0) + 1);
+    ASSERT(std::abs(d.derivative - expected) < 1e-12);
+    ASSERT(expr.eval_with_derivative(context, "z").derivative == (long double)0);
+}
+
+void test_eval_gradient1() {
+    Expression<long double> expr("x * sin(y) + exp(x) / y - ln(x) * cos(x) + y ^ x");
+    std::map<std::string, long double> context = {{"x", 1.5}, {"y", 0.5}};
+    Gradient<long double> gradient = expr.eval_gradient(context);
+    ASSERT(std::abs(gradient.value - expr.eval(context)) < 1e-15);
+    ASSERT(std::abs(gradient.partials[SymbolTable::find("x")] - expr.derivative("x").eval(context)) < 1e-12);
+    ASSERT(std::abs(gradient.partials[SymbolTable::find("y")] - expr.derivative("y").eval(context)) < 1e-12);
+}
+
+void test_eval_gradient2() {
+    std::string text = "v0";
+    for (int i = 1; i < 200; ++i) {
+        text += " + " + std::to_string(i) + " * v" + std::to_string(i) + " ^ 2";
+    }
+    Expression<long double> expr(text);
+    std::map<std::string, long double> context;
+    for (int i = 0; i < 200; ++i) {
+        context["v" + std::to_string(i)] = -1.0;
+    }
+    Gradient<long double> gradient = expr.eval_gradient(context);
+    ASSERT(gradient.partials[SymbolTable::find("v0")] == (long double)1);
+    for (int i = 1; i < 200; ++i) {
+        ASSERT(gradient.partials[SymbolTable::find("v" + std::to_string(i))] == (long double)(-2 * i));
+    }
+}
+
+void test_jit1() {
+    if (!JitExpression::supported()) {
+        return;
+    }
+    Expression<double> expr("x * sin(y) + exp(x) / y - ln(x) * cos(x) + y ^ x - 2.5 * (x - y)");
+    JitExpression jit(expr);
+    for (double x = 0.25; x < 4; x += 0.5) {
+        for (double y = 0.5; y < 3; y += 0.75) {
+            std::map<std::string, double> context = {{"x", x}, {"y", y}};
+            ASSERT(jit.eval(context) == expr.eval(context));
+        }
+    }
+    ASSERT(jit.code_size() > 0);
+}
+
+void test_jit2() {
+    if (!JitExpression::supported()) {
+        return;
+    }
+    std::string text = "v0";
+    for (int i = 1; i < 100; ++i) {
+        text += " + v" + std::to_string(i) + " / (v" + std::to_string(i - 1) + " - 1)";
+    }
+    Expression<double> expr(text);
+    JitExpression jit(expr);
+    std::map<std::string, double> context;
+    for (int i = 0; i < 100; ++i) {
+        context["v" + std::to_string(i)] = 2.0 + i;
+    }
+    ASSERT(jit.eval(context) == expr.eval(context));
+    context["v42"] = 1.0;
+    bool thrown = false;
+    try {
+        jit.eval(context);
+    } catch (const char*) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    JitExpression moved = std::move(jit);
+    context["v42"] = 44.0;
+    ASSERT(moved.eval(context) == expr.eval(context));
+}
+
+void test_arena1() {
+    Expression<double> expr(0.0);
+    std::size_t allocated;
+    {
+        ExpressionArena arena;
+        ExpressionArena::Scope scope(arena);
+        ASSERT(ExpressionArena::current() == &arena);
+        expr = Expression<double>("arena_x * sin(arena_y) + exp(arena_x) / arena_y - 7.25");
+        allocated = arena.bytes_allocated();
+        ASSERT(allocated > 0);
+        Expression<double> d = expr.derivative("arena_x");
+        ASSERT(arena.bytes_allocated() > allocated);
+    }
+    ASSERT(ExpressionArena::current() == nullptr);
+    std::map<std::string, double> context = {{"arena_x", 1.5}, {"arena_y", 0.5}};
+    ASSERT(std::abs(expr.eval(context) - (1.5 * std::sin(0.5) + std::exp(1.5) / 0.5 - 7.25)) < 1e-12);
+}
+
+void test_arena2() {
+    std::string text = "w0";
+    for (int i = 1; i < 2000; ++i) {
+        text += " + " + std::to_string(i) + " * w" + std::to_string(i);
+    }
+    ExpressionArena outer;
+    ExpressionArena inner;
+    Expression<long double> heap(text);
+    {
+        ExpressionArena::Scope first(outer);
+        {
+            ExpressionArena::Scope second(inner);
+            Expression<long double> shared(text);
+            ASSERT(shared == heap);
+            ASSERT(ExpressionArena::current() == &inner);
+        }
+        ASSERT(ExpressionArena::current() == &outer);
+        Expression<long double> fresh(text + " + w2000");
+        ASSERT(outer.bytes_allocated() > 0);
+        std::map<std::string, long double> context;
+        for (int i = 0; i <= 2000; ++i) {
+            context["w" + std::to_string(i)] = 1.0;
+        }
+        ASSERT(fresh.eval(context) == heap.eval(context) + 1);
+    }
+}
+
+void test_arena3() {
+    std::weak_ptr<std::pmr::memory_resource> storage;
+    Expression<double> expr;
+    {
+        ExpressionArena arena;
+        storage = arena.resource();
+        ExpressionArena::Scope scope(arena);
+        expr = Expression<double>("arena3_x * sin(arena3_y) + exp(arena3_x) / arena3_y");
+        expr = expr.derivative("arena3_x") * expr;
+    }
+    ASSERT(!storage.expired());
+    expr = Expression<double>();
+    ASSERT(storage.expired());
+}
+
+void test_flat_expression1() {
+    Expression<double> expr("x * sin(y) + exp(x) / y - ln(x) * cos(x) + y ^ x");
+    FlatExpression<double> flat(expr);
+    ASSERT(sizeof(FlatNode) <= 16);
+    ASSERT(flat.nodes().back().op == OpCode::Add);
+    std::map<std::string, double> context = {{"x", 1.5}, {"y", 0.5}};
+    ASSERT(flat.eval(context) == expr.eval(context));
+    ASSERT(flat.to_expression() == expr);
+    FlatExpression<double> copy = flat;
+    ASSERT(copy == flat && copy.hash() == flat.hash());
+    ASSERT(!(FlatExpression<double>(Expression<double>("x + 0")) == FlatExpression<double>(Expression<double>("x + -0"))));
+}
+
+void test_flat_expression2() {
+    Expression<long double> x("x");
+    Expression<long double> expr = x;
+    for (int i = 0; i < 40; ++i) {
+        expr = expr * expr + x;
+    }
+    FlatExpression<long double> flat(expr);
+    ASSERT(flat.size() == 1 + 2 * 40);
+    ASSERT(flat.to_expression() == expr);
+    std::map<std::string, long double> context = {{"x", 0.25}};
+    ASSERT(flat.eval(context) == expr.compile().eval(context));
+    std::map<std::string, long double> missing;
+    bool thrown = false;
+    try {
+        flat.eval(missing);
+    } catch (const std::string&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void test_flat_expression3() {
+    std::vector<Expression<double>> exprs = {Expression<double>("x * y + sin(x * y)"), Expression<double>("cos(x * y) - y"),
+                                             Expression<double>("x * y")};
+    FlatExpression<double> flat(exprs);
+    ASSERT(flat.roots().size() == 3);
+    // x, y, x * y, sin, + for the first; cos, - for the second; the third is a node already there.
+    ASSERT(flat.size() == 7);
+    ASSERT(flat.roots()[2] == 2 && flat.roots()[0] == 4 && flat.roots()[1] == 6);
+    std::vector<Expression<double>> built = flat.expressions();
+    for (std::size_t i = 0; i < exprs.size(); ++i) {
+        ASSERT(built[flat.roots()[i]] == exprs[i]);
+    }
+    EvalContext<double> context;
+    context.set("x", 1.5);
+    context.set("y", 0.5);
+    std::vector<double> values(flat.size());
+    FlatExpression<double>::run(flat.nodes(), flat.constants().data(), values.data(), context);
+    for (std::size_t i = 0; i < exprs.size(); ++i) {
+        ASSERT(values[flat.roots()[i]] == exprs[i].eval(context));
+    }
+}
+
+void test_static_expression1() {
+    constexpr auto expr = "x * sin(y) + exp(x) / y - ln(x) * cos(x) + y ^ x - -2.5e-1 * (x - .5)"_expr;
+    static_assert(expr.variable_count == 2);
+    static_assert(expr.variables()[0] == "x" && expr.variables()[1] == "y");
+    Expression<double> runtime(std::string(expr.text()));
+    std::map<std::string, double> context = {{"x", 1.5}, {"y", 0.5}};
+    ASSERT(expr(1.5, 0.5) == runtime.eval(context));
+    ASSERT(expr.eval(context) == runtime.eval(context));
+    ASSERT(expr.eval(EvalContext<double>(context)) == runtime.eval(context));
+    ASSERT(expr.expression<double>() == runtime);
+}
+
+void test_static_expression2() {
+    constexpr auto expr = "2 ^ -n ^ 2 / (k - 3) + 17 - k"_expr;
+    ASSERT(expr.eval(std::array<long double, 2>{1, 5}) == Expression<long double>(std::string(expr.text())).eval({{"n", 1}, {"k", 5}}));
+    ASSERT(expr.eval(std::array<int, 2>{2, 4}) == Expression<int>(std::string(expr.text())).eval({{"n", 2}, {"k", 4}}));
+    bool thrown = false;
+    try {
+        expr(1.0, 3.0);
+    } catch (const char*) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    thrown = false;
+    try {
+        expr.eval(std::map<std::string, double>{{"n", 1.0}});
+    } catch (const std::string&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void test_static_expression3() {
+    constexpr auto expr = "2i * z + exp(1.5i) - 1"_expr;
+    using C = std::complex<double>;
+    Expression<C> runtime(std::string(expr.text()));
+    ASSERT(expr(C(0.5, -2)) == runtime.eval({{"z", C(0.5, -2)}}));
+    std::complex<float> z(1, 1);
+    ASSERT(expr.eval(std::array<std::complex<float>, 1>{z}) == Expression<std::complex<float>>(std::string(expr.text())).eval({{"z", z}}));
+}
+
+void test_incremental_evaluator1() {
+    std::string text = "u0";
+    for (int i = 1; i < 200; ++i) {
+        text = "(" + text + ") + sin(u" + std::to_string(i) + ") * " + std::to_string(i);
+    }
+    Expression<double> expr(text);
+    IncrementalEvaluator<double> evaluator(expr);
+    EvalContext<double> context;
+    for (int i = 0; i < 200; ++i) {
+        evaluator.set("u" + std::to_string(i), 0.5 * i);
+        context.set("u" + std::to_string(i), 0.5 * i);
+    }
+    ASSERT(evaluator.eval() == expr.compile().eval(context));
+    ASSERT(evaluator.recomputed() == evaluator.size());
+    evaluator.set("u150", 3.0);
+    context.set("u150", 3.0);
+    ASSERT(evaluator.eval() == expr.compile().eval(context));
+    ASSERT(evaluator.recomputed() == 4 + 49);
+    evaluator.set("u150", 3.0);
+    evaluator.eval();
+    ASSERT(evaluator.recomputed() == 0);
+}
+
+void test_incremental_evaluator2() {
+    Expression<long double> expr("x * x / (y - 1) + exp(x)");
+    IncrementalEvaluator<long double> evaluator(expr);
+    evaluator.set("x", 2.0);
+    bool thrown = false;
+    try {
+        evaluator.eval();
+    } catch (const std::string&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    evaluator.set("y", 1.0);
+    thrown = false;
+    try {
+        evaluator.eval();
+    } catch (const char*) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    evaluator.set("y", 3.0);
+    std::map<std::string, long double> context = {{"x", 2.0}, {"y", 3.0}};
+    ASSERT(evaluator.eval() == expr.eval(context));
+    evaluator.set("x", 0.5);
+    context["x"] = 0.5;
+    ASSERT(evaluator.eval() == expr.eval(context));
+}
+
+void test_expression_file1() {
+    Expression<long double> expr("x * sin(y) + exp(x) / y - ln(x) * cos(x) + y ^ x - 0.1");
+    std::string bytes = save_expression(FlatExpression<long double>(expr), "source text");
+    FlatExpression<long double> loaded = load_expression<long double>(bytes);
+    ASSERT(loaded == FlatExpression<long double>(expr));
+    ASSERT(loaded.to_expression() == expr);
+    std::string path = "expression_file_test.expr";
+    save_expression_file(path, FlatExpression<long double>(expr), "source text");
+    {
+        MappedExpression<long double> mapped(path);
+        std::map<std::string, long double> context = {{"x", 1.5}, {"y", 0.5}};
+        ASSERT(mapped.eval(context) == expr.eval(context));
+        ASSERT(mapped.source() == "source text");
+        ASSERT(mapped.to_expression() == expr);
+    }
+    std::remove(path.c_str());
+}
+
+void test_expression_file2() {
+    std::string bytes = save_expression(FlatExpression<double>(Expression<double>("a / b + 3")));
+    int rejected = 0;
+    auto attempt = [&](const std::string& image) {
+        try {
+            load_expression<double>(image);
+        } catch (const char*) {
+            ++rejected;
+        } catch (const std::string&) {
+            ++rejected;
+        }
+    };
+    attempt(bytes.substr(0, 20));
+    attempt(bytes.substr(0, bytes.size() - 1));
+    std::string other = bytes;
+    other[0] = 'X';
+    attempt(other);
+    ASSERT(rejected == 3);
+    try {
+        load_expression<long double>(bytes);
+    } catch (const char*) {
+        ++rejected;
+    }
+    ASSERT(rejected == 4);
+    ExpressionFileHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    std::string corrupt = bytes;
+    corrupt[header.nodes_offset + 7] = 100;
+    attempt(corrupt);
+    ASSERT(rejected == 5);
+}
+
+void test_parse_cache1() {
+    ParseCache<double> cache(1 << 20);
+    Expression<double> first = cache.parse("x * sin(y) + 2");
+    Expression<double> second = cache.parse("x * sin(y) + 2");
+    ASSERT(first.node() == second.node());
+    ParseCacheStats stats = cache.stats();
+    ASSERT(stats.hits == 1 && stats.misses == 1 && stats.entries == 1 && stats.bytes > 0);
+    ParseCache<double>& shared = ParseCache<double>::shared();
+    shared.set_budget(1 << 20);
+    Expression<double> a("cached_x ^ 2 - cached_y");
+    Expression<double> b("cached_x ^ 2 - cached_y");
+    ASSERT(a == b);
+    ASSERT(shared.stats().hits >= 1);
+    shared.set_budget(0);
+    ASSERT(shared.stats().entries == 0);
+}
+
+void test_parse_cache2() {
+    ParseCache<long double> cache(1 << 16);
+    std::vector<std::string> texts;
+    for (int i = 0; i < 64; ++i) {
+        texts.push_back("x + " + std::to_string(i) + " * y");
+    }
+    ThreadPool pool(4);
+    pool.parallel_for(4096, [&](std::size_t chunk, std::size_t) {
+        Expression<long double> expr = cache.parse(texts[chunk % texts.size()]);
+        if (expr.eval({{"x", 1}, {"y", 1}}) != (long double)(1 + chunk % texts.size())) {
+            throw std::runtime_error("wrong expression from the cache");
+        }
+    });
+    ParseCacheStats stats = cache.stats();
+    ASSERT(stats.hits + stats.misses == 4096);
+    ASSERT(stats.hits >= 4096 - 64 * 4);
+    cache.set_budget(2 * stats.bytes / stats.entries);
+    stats = cache.stats();
+    ASSERT(stats.entries <= 2 && stats.evictions >= 62);
+    ASSERT(stats.bytes <= cache.budget());
+}
+
+void test_profiler1() {
+    Expression<long double> expr("sin(x) * x + 3");
+    ExpressionProfiler<long double> profiler(expr);
+    for (int i = 0; i < 10; ++i) {
+        ASSERT(profiler.eval({{"x", 2}}) == std::sin(2.0L) * 2 + 3);
+    }
+    std::vector<NodeProfile> nodes = profiler.nodes();
+    ASSERT(nodes.size() == 5);
+    std::uint64_t self = 0;
+    for (const NodeProfile& node : nodes) {
+        ASSERT(node.calls == 10);
+        self += node.self_nanoseconds;
+    }
+    ASSERT(nodes.back().subtree_nodes == 5 && nodes.back().total_nanoseconds == self);
+    bool found = false;
+    for (const OperatorProfile& op : profiler.operators()) {
+        if (op.op == OpCode::Variable) {
+            found = true;
+            ASSERT(op.nodes == 1 && op.calls == 10);
+        }
+    }
+    ASSERT(found);
+    ProfileStats stats = profiler.stats();
+    ASSERT(stats.nodes == 5 && stats.depth == 4 && stats.evals == 10);
+    ASSERT(stats.bytes > 0 && stats.nanoseconds == self);
+}
+
+void test_profiler2() {
+    Expression<long double> expr("ln(x) / y");
+    ExpressionProfiler<long double> profiler(expr);
+    bool thrown = false;
+    try {
+        profiler.eval({{"x", 1}});
+    } catch (const std::string&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    profiler.reset();
+    ASSERT(profiler.eval({{"x", 1}, {"y", 2}}) == 0);
+    ASSERT(profiler.stats().evals == 1 && profiler.nodes()[0].calls == 1);
+    std::string report = profiler.report(2);
+    ASSERT(report.find("nodes 4, depth 3") == 0);
+    ASSERT(report.find("ln(x)") != std::string::npos);
+    ASSERT(profiler.describe(profiler.nodes().size() - 1, 6) == "(ln...");
+}
+
+void test_write_to1() {
+    for (const char* text : {"a - (b - c) * 2 ^ 3 ^ x / (d + 0.1)", "(a ^ b) ^ c", "a + (b + c)", "x / (y * z) - ln(exp(x))"}) {
+        Expression<double> expr(text);
+        std::string out;
+        expr.write_to(out);
+        ASSERT(out == text);
+        ASSERT(Expression<double>(out) == expr);
+    }
+    std::string out = "y = ";
+    (Expression<double>("x") * Expression<double>(-2.5) + Expression<double>(1e20)).write_to(out);
+    ASSERT(out == "y = x * (-2.5) + 1e+20");
+}
+
+void test_write_to2() {
+    Expression<long double> expr("x");
+    for (int i = 0; i < 20000; ++i) {
+        expr = sin(expr) * Expression<long double>("y") + Expression<long double>(0.125L * i);
+    }
+    std::string compact;
+    expr.write_to(compact);
+    std::ostringstream stream;
+    stream << expr;
+    ASSERT(stream.str() == compact);
+    ASSERT(compact.starts_with("sin(sin("));
+    ASSERT(compact.ends_with(") * y + 2499.75) * y + 2499.875"));
+    std::string legacy = expr.to_string();
+    ASSERT(legacy.starts_with("((sin(((sin(") && legacy.ends_with(" * y) + 2499.750000)) * y) + 2499.875000)"));
+    ASSERT(legacy.size() > compact.size());
+}
+
+void test_write_shared1() {
+    Expression<double> expr("sin(x * y) / cos(x * y) + t1");
+    std::string out;
+    expr.write_shared(out, "f");
+    ASSERT(out == "t2 = x * y; f = sin(t2) / cos(t2) + t1");
+    ASSERT(Expression<double>("x + 2").diff_shared("x") == "result = 1 + 0");
+}
+
+void test_write_shared2() {
+    Expression<double> expr("x");
+    for (int i = 0; i < 12; ++i) {
+        expr = sin(expr) * expr + Expression<double>("y");
+    }
+    std::string text = expr.diff_shared("x");
+    ASSERT(text.size() < 20 * FlatExpression<double>(expr.derivative("x")).size());
+    // Evaluates the bindings one after another, each seeing the ones before it.
+    std::map<std::string, double> context = {{"x", 0.3}, {"y", -0.2}};
+    std::size_t begin = 0;
+    double result = 0;
+    while (begin < text.size()) {
+        std::size_t end = text.find("; ", begin);
+        std::string binding = text.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+        std::size_t equals = binding.find(" = ");
+        result = Expression<double>(binding.substr(equals + 3)).compile().eval(context);
+        context[binding.substr(0, equals)] = result;
+        begin = end == std::string::npos ? text.size() : end + 2;
+    }
+    ASSERT(context.contains("result"));
+    ASSERT(std::abs(result - expr.derivative("x").compile().eval({{"x", 0.3}, {"y", -0.2}})) < 1e-9);
+}
+
+void test_jacobian1() {
+    Jacobian<double> jacobian({Expression<double>("x * y"), Expression<double>("sin(z) + 2"), Expression<double>("x + 3 * 0 * y")});
+    ASSERT((jacobian.variables() == std::vector<std::string>{"x", "y", "z"}));
+    const SparsityPattern& pattern = jacobian.pattern();
+    ASSERT(pattern.rows == 3 && pattern.columns == 3 && pattern.nonzeros() == 4);
+    ASSERT((pattern.row_begin == std::vector<std::uint32_t>{0, 2, 3, 4}));
+    ASSERT((pattern.column == std::vector<std::uint32_t>{0, 1, 2, 0}));
+    ASSERT(jacobian.entry(0, 1) == Expression<double>("x"));
+    ASSERT(jacobian.entry(1, 0) == Expression<double>(0.0));
+    SparseMatrix<double> values = jacobian.eval({{"x", 2}, {"y", 5}, {"z", 0}});
+    ASSERT((values.dense() == std::vector<double>{5, 2, 0, 0, 0, 1, 1, 0, 0}));
+    ASSERT(values.at(2, 2) == 0 && values.at(1, 2) == 1);
+}
+
+void test_jacobian2() {
+    Jacobian<double> hessian = Jacobian<double>::hessian(Expression<double>("x ^ 2 * y + sin(z) + w"));
+    ASSERT((hessian.variables() == std::vector<std::string>{"w", "x", "y", "z"}));
+    ASSERT(hessian.pattern().nonzeros() == 4);
+    ASSERT(hessian.entry(1, 2) == hessian.entry(2, 1));
+    SparseMatrix<double> h = hessian.eval({{"w", 1}, {"x", 3}, {"y", 0.5}, {"z", 0}});
+    ASSERT(h.at(1, 1) == 1 && h.at(1, 2) == 6 && h.at(2, 1) == 6 && h.at(3, 3) == 0 && h.at(0, 0) == 0);
+    // A chain x_i * x_(i+1) over 300 variables has two non-zeros per row.
+    const int n = 300;
+    std::vector<Expression<double>> functions;
+    std::vector<std::string> variables;
+    EvalContext<double> context;
+    for (int i = 0; i < n; ++i) {
+        variables.push_back("c" + std::to_string(i));
+        context.set(variables.back(), i);
+    }
+    for (int i = 0; i + 1 < n; ++i) {
+        functions.push_back(Expression<double>(variables[i]) * Expression<double>(variables[i + 1]));
+    }
+    Jacobian<double> chain(functions, variables);
+    ASSERT(chain.pattern().nonzeros() == 2 * (n - 1));
+    SparseMatrix<double> j = chain.eval(context);
+    ASSERT(j.at(10, 10) == 11 && j.at(10, 11) == 10 && j.at(10, 12) == 0);
+    std::vector<double> out(3);
+    bool thrown = false;
+    try {
+        chain.eval(context, out);
+    } catch (const std::string&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void test_eval_interval1() {
+    Expression<double> square("x ^ 2");
+    Interval<double> r = square.eval_interval({{"x", {-1, 2}}});
+    ASSERT(r.lo <= 0 && r.lo > -1e-12 && r.hi >= 4 && r.hi < 4 + 1e-12);
+    r = Expression<double>("1 / x").eval_interval({{"x", {0, 2}}});
+    ASSERT(r.lo <= 0.5 && r.lo > 0.49 && r.hi == INFINITY);
+    r = Expression<double>("1 / x").eval_interval({{"x", {-1, 2}}});
+    ASSERT(r.lo == -INFINITY && r.hi == INFINITY);
+    r = Expression<double>("sin(x)").eval_interval({{"x", {0.1, 3}}});
+    ASSERT(r.hi == 1 && r.lo <= std::sin(0.1) && r.lo > std::sin(0.1) - 1e-12);
+    r = Expression<double>("cos(x)").eval_interval({{"x", {-100, 100}}});
+    ASSERT(r.lo == -1 && r.hi == 1);
+    r = Expression<double>("ln(x)").eval_interval({{"x", {-1, 1}}});
+    ASSERT(r.lo == -INFINITY && r.hi >= 0 && r.hi < 1e-12);
+    ASSERT(std::isnan(Expression<double>("ln(x)").eval_interval({{"x", {-2, -1}}}).lo));
+    Interval<int> i = Expression<int>("x * y - 3").eval_interval({{"x", {-2, 3}}, {"y", {1, 4}}});
+    ASSERT(i.lo == -11 && i.hi == 9);
+    bool thrown = false;
+    try {
+        square.eval_interval({{"y", 1.0}});
+    } catch (const std::string&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void test_eval_interval2() {
+    Expression<double> expr("sin(x * y) / (x - 0.5) + exp(cos(y)) ^ x - ln(x + 2) * y ^ 3");
+    CompiledExpression<double> program = expr.compile();
+    std::mt19937 random(7);
+    std::uniform_real_distribution<double> unit(0, 1);
+    for (int box = 0; box < 200; ++box) {
+        double x0 = unit(random) * 4 - 1.5, y0 = unit(random) * 6 - 3;
+        double x1 = x0 + unit(random) * (box % 2 ? 0.1 : 2), y1 = y0 + unit(random) * (box % 3 ? 0.1 : 3);
+        Interval<double> range = program.eval_interval({{"x", {x0, x1}}, {"y", {y0, y1}}});
+        for (int i = 0; i < 50; ++i) {
+            double x = x0 + (x1 - x0) * unit(random), y = y0 + (y1 - y0) * unit(random);
+            if (x == 0.5) {
+                continue;
+            }
+            double value = program.eval({{"x", x}, {"y", y}});
+            ASSERT(std::isnan(value) || range.contains(value));
+        }
+    }
+}
+
+void test_complex1() {
+    using C = std::complex<double>;
+    Expression<C> expr("(x + 2i) * exp(y) / (1 - x) - ln(x) ^ 2");
+    std::map<std::string, C> context = {{"x", C(0.5, 1)}, {"y", C(0, 1)}};
+    C value = (C(0.5, 1) + C(0, 2)) * std::exp(C(0, 1)) / (C(1) - C(0.5, 1)) - std::pow(std::log(C(0.5, 1)), C(2));
+    ASSERT(std::abs(expr.eval(context) - value) < 1e-12);
+    ASSERT(std::abs(expr.compile().eval(context) - value) < 1e-12);
+    ASSERT(std::abs(FlatExpression<C>(expr).eval(context) - value) < 1e-12);
+    std::string text;
+    expr.write_to(text);
+    ASSERT(text == "(x + 2i) * exp(y) / (1 - x) - ln(x) ^ 2");
+    ASSERT(Expression<C>(text) == expr);
+    // d/dx x^2 at 1 + i is 2 + 2i.
+    ASSERT(std::abs(Expression<C>("x ^ 2").derivative("x").eval({{"x", C(1, 1)}}) - C(2, 2)) < 1e-12);
+    FlatExpression<C> loaded = load_expression<C>(save_expression(FlatExpression<C>(expr)));
+    ASSERT(loaded == FlatExpression<C>(expr));
+    bool thrown = false;
+    try {
+        load_expression<double>(save_expression(FlatExpression<C>(expr)));
+    } catch (const char*) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    Expression<std::complex<float>> single("x * 3i + 1");
+    ASSERT(single.eval({{"x", std::complex<float>(1, 1)}}) == std::complex<float>(-2, 3));
+}
+
+void test_complex2() {
+    using C = std::complex<double>;
+    // Transfer function over a frequency grid.
+    CompiledExpression<C> h = Expression<C>("(s + 3) * (s - 1i) / (s * s + 0.5 * s + 1) + exp(1i * s) - ln(s)").compile();
+    const std::size_t n = 1003;
+    std::vector<C> s(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        s[i] = C(0.01, 0.05 * (i + 1));
+    }
+    std::vector<C> out(n);
+    h.eval_batch({{"s", s.data()}}, n, out.data());
+    ThreadPool pool(3);
+    std::vector<C> parallel(n);
+    h.eval_batch({{"s", s.data()}}, n, parallel.data(), pool);
+    for (std::size_t i = 0; i < n; ++i) {
+        C expected = h.eval({{"s", s[i]}});
+        ASSERT(std::abs(out[i] - expected) <= 1e-12 * std::abs(expected));
+        ASSERT(parallel[i] == out[i]);
+    }
+    // Divisors whose squared magnitude overflows or underflows take the scaled scalar path.
+    std::vector<C> a = {{1, 2}, {3e150, -1e150}, {1e-160, 1e-160}, {-4, 0.5}, {2, 2}};
+    std::vector<C> b = {{2, -1}, {1e200, 1e200}, {1e-170, -3e-170}, {0.25, 0.5}, {1e-300, 0}};
+    std::vector<C> quotients(a.size());
+    Expression<C>("x / y").compile().eval_batch({{"x", a.data()}, {"y", b.data()}}, a.size(), quotients.data());
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        C expected = a[i] / b[i];
+        ASSERT(std::abs(quotients[i] - expected) <= 1e-14 * std::abs(expected));
+    }
+    std::vector<std::complex<float>> x = {{1, 2}, {3, -1}, {0.5f, 0.25f}};
+    std::vector<std::complex<float>> y(3);
+    Expression<std::complex<float>>("x * x / (x + 1i)").compile().eval_batch({{"x", x.data()}}, 3, y.data());
+    ASSERT(std::abs(y[1] - x[1] * x[1] / (x[1] + std::complex<float>(0, 1))) < 1e-5f);
+}
+
+void test_complex3() {
+    using C = std::complex<double>;
+    Expression<C> expr("ln(exp(z))");
+    ASSERT(expr.simplify() == expr);
+    C z(0.5, 4.0);
+    C value = expr.simplify().eval({{"z", z}});
+    ASSERT(std::abs(value - std::log(std::exp(z))) < 1e-12);
+    ASSERT(std::abs(value - z) > 1);
+    ASSERT(Expression<double>("ln(exp(z))").simplify().to_string() == "z");
 }
 
 int main() {
@@ -718,4 +1706,64 @@ int main() {
     RUN_TEST(test_diff_exp2);
     RUN_TEST(test_to_string_exp1);
     RUN_TEST(test_to_string_exp2);
+
+    RUN_TEST(test_compile1);
+    RUN_TEST(test_compile2);
+    RUN_TEST(test_compile3);
+    RUN_TEST(test_compile4);
+    RUN_TEST(test_eval_context1);
+    RUN_TEST(test_eval_context2);
+    RUN_TEST(test_eval_context3);
+    RUN_TEST(test_eval_context4);
+    RUN_TEST(test_eval_batch1);
+    RUN_TEST(test_eval_batch2);
+    RUN_TEST(test_eval_batch3);
+    RUN_TEST(test_eval_batch_parallel1);
+    RUN_TEST(test_eval_batch_parallel2);
+    RUN_TEST(test_parse1);
+    RUN_TEST(test_parse2);
+    RUN_TEST(test_parse3);
+    RUN_TEST(test_parse4);
+    RUN_TEST(test_parse5);
+    RUN_TEST(test_derivative1);
+    RUN_TEST(test_derivative2);
+    RUN_TEST(test_derivative3);
+    RUN_TEST(test_hash_consing1);
+    RUN_TEST(test_hash_consing2);
+    RUN_TEST(test_simplify1);
+    RUN_TEST(test_simplify2);
+    RUN_TEST(test_eval_with_derivative1);
+    RUN_TEST(test_eval_with_derivative2);
+    RUN_TEST(test_eval_gradient1);
+    RUN_TEST(test_eval_gradient2);
+    RUN_TEST(test_jit1);
+    RUN_TEST(test_jit2);
+    RUN_TEST(test_arena1);
+    RUN_TEST(test_arena2);
+    RUN_TEST(test_arena3);
+    RUN_TEST(test_flat_expression1);
+    RUN_TEST(test_flat_expression2);
+    RUN_TEST(test_flat_expression3);
+    RUN_TEST(test_static_expression1);
+    RUN_TEST(test_static_expression2);
+    RUN_TEST(test_static_expression3);
+    RUN_TEST(test_incremental_evaluator1);
+    RUN_TEST(test_incremental_evaluator2);
+    RUN_TEST(test_expression_file1);
+    RUN_TEST(test_expression_file2);
+    RUN_TEST(test_parse_cache1);
+    RUN_TEST(test_parse_cache2);
+    RUN_TEST(test_profiler1);
+    RUN_TEST(test_profiler2);
+    RUN_TEST(test_write_to1);
+    RUN_TEST(test_write_to2);
+    RUN_TEST(test_write_shared1);
+    RUN_TEST(test_write_shared2);
+    RUN_TEST(test_jacobian1);
+    RUN_TEST(test_jacobian2);
+    RUN_TEST(test_eval_interval1);
+    RUN_TEST(test_eval_interval2);
+    RUN_TEST(test_complex1);
+    RUN_TEST(test_complex2);
+    RUN_TEST(test_complex3);
 }
\ No newline at end of file